@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+#include "du-proto.h"
+
+/*
+ * du-proto transport benchmark
+ * Sends the same data from a client to a server on this host over
+   loopback UDP, over the same host link and over a local socket (see
+   du-proto.h) and prints the throughput of each.  The server runs in a
+   child process, as it would for a real transfer.  "make bench" builds
+   and runs it.
+ * The link and the local socket carry large fragments, at the same ACK
+   cadence they also ACK far fewer bytes at a time.  UDP runs a second
+   time ACKing every BENCH_UDP_ACK_EVERY fragments, about as few ACKs
+   as it can do with, and both are compared with that run as well.
+ * du-proto prints every PDU, that goes to /dev/null while the runs
+   last and only the results and errors are shown.
+ */
+#define BENCH_PORT      47100
+#define BENCH_PATH      "/tmp/du-bench.%d.sock"
+#define BENCH_MSG_SZ    65536
+#define BENCH_DEF_MB    64
+#define BENCH_UDP_ACK_EVERY 256
+
+#define BENCH_UDP       0
+#define BENCH_SHM       1
+#define BENCH_UNIX      2
+
+static char benchBuf[BENCH_MSG_SZ];
+
+static double bench_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static dp_connp bench_init(int server, int port, int mode){
+    char path[64];
+
+    snprintf(path, sizeof(path), BENCH_PATH, port);
+    if (mode == BENCH_UNIX)
+        return server ? dpServerInitUnix(path) : dpClientInitUnix(path);
+    return server ? dpServerInit(port) : dpClientInit("127.0.0.1", port);
+}
+
+static void bench_server(int port, int mode, int ack_every){
+    dp_connp dp = bench_init(1, port, mode);
+
+    if (dp == NULL)
+        exit(-1);
+    dpsetshm(dp, mode == BENCH_SHM);
+    dpsetackevery(dp, ack_every);
+    if (dplisten(dp) < 0)
+        exit(-1);
+    while (dprecv(dp, benchBuf, sizeof(benchBuf)) >= 0)
+        ;
+    exit(0);
+}
+
+/*
+ * One run, returns the throughput in MB/s or a negative value if the
+   transfer failed
+*/
+static double bench_run(int port, int mode, int ack_every, long total){
+    double start, secs;
+    long sent;
+    pid_t pid;
+    dp_connp dp;
+
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+        bench_server(port, mode, ack_every);
+    usleep(200000);
+
+    dp = bench_init(0, port, mode);
+    if (dp == NULL)
+        return -1;
+    dpsetshm(dp, mode == BENCH_SHM);
+    dpsetackevery(dp, ack_every);
+    if (dpconnect(dp) < 0) {
+        fprintf(stderr, "bench: cannot connect\n");
+        return -1;
+    }
+
+    start = bench_now();
+    for (sent = 0; sent < total; sent += BENCH_MSG_SZ) {
+        if (dpsend(dp, benchBuf, BENCH_MSG_SZ) != BENCH_MSG_SZ) {
+            fprintf(stderr, "bench: send failed after %ld bytes\n", sent);
+            break;
+        }
+    }
+    secs = bench_now() - start;
+    dpdisconnect(dp);
+    waitpid(pid, NULL, 0);
+    return (sent < total) ? -1 : sent / secs / 1e6;
+}
+
+static void bench_ratio(const char *name, double rate, double udp, double udpFew){
+    printf("\t%-18s%8.1f MB/s", name, rate);
+    if (udp > 0 && rate > 0)
+        printf("  %5.1fx", rate / udp);
+    if (udpFew > 0 && rate > 0)
+        printf("  %5.1fx UDP with fewer ACKs", rate / udpFew);
+    printf("\n");
+}
+
+int main(int argc, char *argv[]){
+    long mb = BENCH_DEF_MB;
+    int port = BENCH_PORT, ackEvery = DP_DEF_ACK_EVERY, option, out;
+    double udp, udpFew = -1, shm, local;
+
+    while ((option = getopt(argc, argv, "n:p:k:h")) != -1) {
+        switch (option) {
+            case 'n':
+                mb = atol(optarg);
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'k':
+                ackEvery = atoi(optarg);
+                break;
+            default:
+                printf("USAGE: %s [-n mbytes] [-p port] [-k n]\n", argv[0]);
+                printf("\t[-n mbytes] data sent per run; DEFAULT = %d\n", BENCH_DEF_MB);
+                printf("\t[-p port] first of the four ports used; DEFAULT = %d\n", BENCH_PORT);
+                printf("\t[-k n] ACK fragments n at a time; DEFAULT = %d\n", DP_DEF_ACK_EVERY);
+                exit(0);
+        }
+    }
+
+    memset(benchBuf, 'x', sizeof(benchBuf));
+
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    freopen("/dev/null", "w", stdout);
+    udp = bench_run(port, BENCH_UDP, ackEvery, mb * 1000000);
+    if (ackEvery < BENCH_UDP_ACK_EVERY)
+        udpFew = bench_run(port + 3, BENCH_UDP, BENCH_UDP_ACK_EVERY, mb * 1000000);
+    shm = bench_run(port + 1, BENCH_SHM, ackEvery, mb * 1000000);
+    local = bench_run(port + 2, BENCH_UNIX, ackEvery, mb * 1000000);
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    printf("\n%ld MB in %d byte messages, ACK every %d fragments\n", mb, BENCH_MSG_SZ, ackEvery);
+    bench_ratio("loopback UDP:", udp, -1, -1);
+    if (ackEvery < BENCH_UDP_ACK_EVERY)
+        printf("\tloopback UDP:     %8.1f MB/s  ACK every %d fragments\n", udpFew, BENCH_UDP_ACK_EVERY);
+    bench_ratio("same host link:", shm, udp, udpFew);
+    bench_ratio("local socket:", local, udp, udpFew);
+    return (udp > 0 && shm > 0 && local > 0 && (udpFew > 0 || ackEvery >= BENCH_UDP_ACK_EVERY)) ? 0 : -1;
+}
@@ -0,0 +1,227 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "du-comp.h"
+
+/*
+ * Hashes the next DZ_MIN_MATCH bytes of the window into
+   a bucket of the head table
+*/
+static unsigned int dzhash(const unsigned char *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - DZ_HASH_BITS);
+}
+
+/*
+ * Records window position pos in the hash chains so that
+   later data can find it as a match candidate
+*/
+static void dzinsert(dz_stream *zs, int pos){
+    unsigned int h = dzhash(zs->win + pos);
+    zs->prev[pos] = zs->head[h];
+    zs->head[h] = pos;
+}
+
+/*
+ * Resets a stream so it has no history.
+ * Both the sender and receiver must start from the same state.
+*/
+void dzinit(dz_stream *zs){
+    zs->hist = 0;
+    memset(zs->head, -1, sizeof(zs->head));
+}
+
+/*
+ * Makes room for a block of in_sz bytes at the end of the window.
+ * If the block does not fit, only the last DZ_HIST_SZ bytes of history
+   are kept and moved to the front of the window, then the hash chains
+   are rebuilt over them.  The sender and receiver call this with the
+   same sizes, so their windows always stay identical.  Only the sender
+   searches for matches, so the receiver skips the re-indexing.
+*/
+static void dzslide(dz_stream *zs, int in_sz, int reindex){
+    int keep, i;
+
+    if (zs->hist + in_sz <= DZ_WIN_SZ)
+        return;
+
+    keep = zs->hist < DZ_HIST_SZ ? zs->hist : DZ_HIST_SZ;
+    memmove(zs->win, zs->win + zs->hist - keep, keep);
+    zs->hist = keep;
+
+    if (!reindex)
+        return;
+    memset(zs->head, -1, sizeof(zs->head));
+    for (i = 0; i + DZ_MIN_MATCH <= keep; i++)
+        dzinsert(zs, i);
+}
+
+/*
+ * Receiver side: adds a block that was sent uncompressed to the
+   window so that later compressed blocks can reference it.
+*/
+void dzappend(dz_stream *zs, const void *in, int in_sz){
+    dzslide(zs, in_sz, 0);
+    memcpy(zs->win + zs->hist, in, in_sz);
+    zs->hist += in_sz;
+}
+
+/*
+ * Compresses one block of at most DZ_BLOCK_SZ bytes into out.
+ * The block always becomes part of the window, even when it does not
+   compress, because the receiver will append the raw block to its own
+   window in that case.
+ * Returns the compressed size, or DZ_NO_GAIN if the result would not
+   be smaller than the input (or would not fit in out_sz bytes).
+*/
+int dzcompress(dz_stream *zs, const void *in, int in_sz, void *out, int out_sz){
+    unsigned char *op = out;
+    unsigned char *oend;
+    int pos, end, litStart, limit;
+
+    if (in_sz <= 0 || in_sz > DZ_BLOCK_SZ)
+        return DZ_NO_GAIN;
+
+    // Anything that is not smaller than the raw block is not worth sending
+    if (out_sz >= in_sz)
+        out_sz = in_sz - 1;
+    oend = op + out_sz;
+
+    dzslide(zs, in_sz, 1);
+    memcpy(zs->win + zs->hist, in, in_sz);
+
+    pos = litStart = zs->hist;
+    end = zs->hist + in_sz;
+
+    while (pos < end) {
+        int bestLen = 0, bestOff = 0;
+
+        if (pos + DZ_MIN_MATCH <= end) {
+            int cand = zs->head[dzhash(zs->win + pos)];
+            int probes = DZ_MAX_PROBES;
+
+            limit = end - pos;
+            if (limit > DZ_MAX_MATCH)
+                limit = DZ_MAX_MATCH;
+
+            while (cand >= 0 && probes-- > 0 && pos - cand <= 0xffff) {
+                int len = 0;
+                while (len < limit && zs->win[cand + len] == zs->win[pos + len])
+                    len++;
+                if (len > bestLen) {
+                    bestLen = len;
+                    bestOff = pos - cand;
+                    if (len == limit)
+                        break;
+                }
+                cand = zs->prev[cand];
+            }
+            dzinsert(zs, pos);
+        }
+
+        if (bestLen < DZ_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+
+        // Flush pending literals, then emit the match
+        while (litStart < pos) {
+            int run = pos - litStart;
+            if (run > DZ_MAX_LITERAL)
+                run = DZ_MAX_LITERAL;
+            if (op + 1 + run > oend)
+                goto no_gain;
+            *op++ = run - 1;
+            memcpy(op, zs->win + litStart, run);
+            op += run;
+            litStart += run;
+        }
+        if (op + 3 > oend)
+            goto no_gain;
+        *op++ = 0x80 | (bestLen - DZ_MIN_MATCH);
+        *op++ = bestOff & 0xff;
+        *op++ = bestOff >> 8;
+
+        for (int i = 1; i < bestLen; i++)
+            if (pos + i + DZ_MIN_MATCH <= end)
+                dzinsert(zs, pos + i);
+        pos += bestLen;
+        litStart = pos;
+    }
+
+    while (litStart < end) {
+        int run = end - litStart;
+        if (run > DZ_MAX_LITERAL)
+            run = DZ_MAX_LITERAL;
+        if (op + 1 + run > oend)
+            goto no_gain;
+        *op++ = run - 1;
+        memcpy(op, zs->win + litStart, run);
+        op += run;
+        litStart += run;
+    }
+
+    zs->hist = end;
+    return op - (unsigned char *)out;
+
+no_gain:
+    // Still index the rest of the block so the windows match the receiver,
+    // pos itself is indexed already (or past the last position that is)
+    for (pos++; pos + DZ_MIN_MATCH <= end; pos++)
+        dzinsert(zs, pos);
+    zs->hist = end;
+    return DZ_NO_GAIN;
+}
+
+/*
+ * Decompresses one block produced by dzcompress() into out.
+ * out_sz must be the exact raw size of the block, which the sender
+   carries in its own header.
+ * Returns the number of bytes decoded, or DZ_ERROR_BAD_DATA if the
+   block references data outside of the window or is truncated.
+*/
+int dzdecompress(dz_stream *zs, const void *in, int in_sz, void *out, int out_sz){
+    const unsigned char *ip = in;
+    const unsigned char *iend = ip + in_sz;
+    int op, end, i;
+
+    if (out_sz <= 0 || out_sz > DZ_BLOCK_SZ)
+        return DZ_ERROR_BAD_DATA;
+
+    dzslide(zs, out_sz, 0);
+    op = zs->hist;
+    end = zs->hist + out_sz;
+
+    while (ip < iend) {
+        int c = *ip++;
+
+        if (c < 0x80) {
+            int run = c + 1;
+            if (ip + run > iend || op + run > end)
+                return DZ_ERROR_BAD_DATA;
+            memcpy(zs->win + op, ip, run);
+            ip += run;
+            op += run;
+        } else {
+            int len = (c & 0x7f) + DZ_MIN_MATCH;
+            int off;
+            if (ip + 2 > iend)
+                return DZ_ERROR_BAD_DATA;
+            off = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (off == 0 || off > op || op + len > end)
+                return DZ_ERROR_BAD_DATA;
+            // Byte by byte, the match may overlap the bytes it produces
+            for (i = 0; i < len; i++, op++)
+                zs->win[op] = zs->win[op - off];
+        }
+    }
+
+    if (op != end)
+        return DZ_ERROR_BAD_DATA;
+
+    memcpy(out, zs->win + zs->hist, out_sz);
+    zs->hist = end;
+    return out_sz;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+/*
+ * du-ftp block compressor (dz)
+ * A small LZ77 style codec used to shrink file blocks before they are
+   handed to dpsend().  Both ends keep a sliding window of the data that
+   has already been exchanged, so a block may reference text that was
+   sent in an earlier block (streaming compression).
+ * Encoded format, one control byte at a time:
+ *      0xxxxxxx            literal run of (x + 1) bytes that follow
+ *      1xxxxxxx lo hi      match of (x + DZ_MIN_MATCH) bytes starting
+                            (hi << 8 | lo) bytes back in the window
+ */
+#define     DZ_HIST_SZ          32768
+#define     DZ_BLOCK_SZ         32768
+#define     DZ_WIN_SZ           (DZ_HIST_SZ + DZ_BLOCK_SZ)
+#define     DZ_HASH_BITS        14
+#define     DZ_MIN_MATCH        4
+#define     DZ_MAX_MATCH        (0x7f + DZ_MIN_MATCH)
+#define     DZ_MAX_LITERAL      0x80
+#define     DZ_MAX_PROBES       16
+
+#define     DZ_NO_GAIN          -1      //block did not shrink, send it raw
+#define     DZ_ERROR_BAD_DATA   -2      //compressed block is corrupt
+
+typedef struct dz_stream {
+    int             hist;                       //bytes of history before the current block
+    int             head[1 << DZ_HASH_BITS];    //most recent window position per hash
+    int             prev[DZ_WIN_SZ];            //previous window position with the same hash
+    unsigned char   win[DZ_WIN_SZ];
+} dz_stream;
+
+void dzinit(dz_stream *zs);
+int  dzcompress(dz_stream *zs, const void *in, int in_sz, void *out, int out_sz);
+int  dzdecompress(dz_stream *zs, const void *in, int in_sz, void *out, int out_sz);
+void dzappend(dz_stream *zs, const void *in, int in_sz);
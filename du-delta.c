@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "du-delta.h"
+
+/*
+ * Computes the rsync style weak checksum of a block.
+ * The low 16 bits hold the plain sum of the bytes, the high 16 bits
+   hold the sum weighted by distance from the end of the block, which
+   lets ddroll() move the window one byte at a time.
+*/
+uint32_t ddweak(const void *buff, int len){
+    const unsigned char *p = buff;
+    uint32_t a = 0, b = 0;
+
+    for (int i = 0; i < len; i++) {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+/*
+ * Slides the weak checksum of a len byte window forward one byte,
+   dropping out from the front and adding in at the back
+*/
+uint32_t ddroll(uint32_t weak, unsigned char out, unsigned char in, int len){
+    uint32_t a = weak & 0xffff;
+    uint32_t b = weak >> 16;
+
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)len * out + a) & 0xffff;
+    return a | (b << 16);
+}
+
+/*
+ * Folds len bytes into a running FNV-1a hash, start
+   with DD_STRONG_INIT for a new hash
+*/
+uint64_t ddstrong(uint64_t hash, const void *buff, int len){
+    const unsigned char *p = buff;
+
+    for (int i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Builds a chained hash table keyed on the weak checksum
+   over count signatures.  The table does not copy sigs,
+   and only points at them once it could be built.
+*/
+int ddtable_init(dd_table *tbl, dd_sig *sigs, int count){
+    uint32_t size = 1;
+
+    while (size < (uint32_t)count * 2)
+        size <<= 1;
+
+    tbl->sigs = NULL;
+    tbl->count = 0;
+    tbl->mask = size - 1;
+    tbl->bucket = malloc(size * sizeof(int));
+    tbl->next = malloc((count > 0 ? count : 1) * sizeof(int));
+    if (tbl->bucket == NULL || tbl->next == NULL) {
+        ddtable_free(tbl);
+        return -1;
+    }
+    tbl->sigs = sigs;
+    tbl->count = count;
+
+    memset(tbl->bucket, -1, size * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        uint32_t h = (sigs[i].weak * 2654435761u) & tbl->mask;
+        tbl->next[i] = tbl->bucket[h];
+        tbl->bucket[h] = i;
+    }
+    return 0;
+}
+
+/*
+ * Looks up a DD_BLOCK_SZ window of the sender's file.
+ * The strong hash is only computed once the weak checksum hits.
+ * Returns the index of the receiver's matching block or -1.
+*/
+int ddtable_find(dd_table *tbl, uint32_t weak, const void *block){
+    uint32_t h = (weak * 2654435761u) & tbl->mask;
+    uint64_t strong = 0;
+    _Bool haveStrong = 0;
+
+    for (int i = tbl->bucket[h]; i >= 0; i = tbl->next[i]) {
+        if (tbl->sigs[i].weak != weak)
+            continue;
+        if (!haveStrong) {
+            strong = ddstrong(DD_STRONG_INIT, block, DD_BLOCK_SZ);
+            haveStrong = 1;
+        }
+        if (tbl->sigs[i].strong == strong)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Releases the lookup table, the signatures
+   themselves belong to the caller
+*/
+void ddtable_free(dd_table *tbl){
+    free(tbl->bucket);
+    free(tbl->next);
+    tbl->bucket = NULL;
+    tbl->next = NULL;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * du-ftp delta helpers (dd)
+ * The receiver of a delta transfer splits its existing copy of a file into
+   DD_BLOCK_SZ blocks and sends a signature for each one.  The sender slides
+   a window over its own copy using the cheap rolling (weak) checksum, and
+   only when the weak checksum hits a signature does it confirm the block
+   with the strong hash.  Matching blocks are sent as block references, all
+   other bytes are sent as literal data.
+ * The strong hash is 64 bit FNV-1a, it is also used to check the whole
+   rebuilt file at the end of the transfer.
+ */
+#define     DD_BLOCK_SZ         1024
+#define     DD_STRONG_INIT      0xcbf29ce484222325ULL
+
+typedef struct dd_sig {
+    uint32_t    weak;
+    uint64_t    strong;
+} dd_sig;
+
+//Lookup table over the signatures of the receiver's blocks
+typedef struct dd_table {
+    dd_sig      *sigs;
+    int         count;
+    int         *bucket;
+    int         *next;
+    uint32_t    mask;
+} dd_table;
+
+uint32_t ddweak(const void *buff, int len);
+uint32_t ddroll(uint32_t weak, unsigned char out, unsigned char in, int len);
+uint64_t ddstrong(uint64_t hash, const void *buff, int len);
+
+int  ddtable_init(dd_table *tbl, dd_sig *sigs, int count);
+int  ddtable_find(dd_table *tbl, uint32_t weak, const void *block);
+void ddtable_free(dd_table *tbl);
@@ -4,21 +4,59 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "du-ftp.h"
 #include "du-proto.h"
+#include "du-rpc.h"
+#include "du-stream.h"
+#include "du-queue.h"
+#include "du-comp.h"
+#include "du-delta.h"
 
 
 #define BUFF_SZ 512
 static char sbuffer[BUFF_SZ];
 static char rbuffer[BUFF_SZ];
-static char full_file_path[FNAME_SZ];
+static char full_file_path[FPATH_SZ];
 
-// Larger buffers to store the whole file
+// Larger buffer to store the whole file
 #define BIG_BUFF_SZ 1000000
-static char sBigBuffer[BIG_BUFF_SZ];
 static char rBigBuffer[BIG_BUFF_SZ];
 
+// The message being built.  Record headers, small payloads and compressed
+// blocks are staged in sStage, larger file data is sent from the file
+// mapping where it is, sIov lists the pieces in order
+static char sStage[FTP_MSG_SZ];
+static struct iovec sIov[FTP_MSG_IOV];
+static int sIovCnt = 0;
+static int sStageSz = 0;
+static int sRefs = 0;
+
+// Compression state, one side of the session only ever uses it in one direction
+static dz_stream zStream;
+static char zBuffer[FTP_BLOCK_SZ];
+
+// Size of the message being built and the one being read out of rBigBuffer
+static int sMsgSz = 0;
+static int rMsgSz = 0;
+static int rMsgOff = 0;
+
+// Server writer thread and the ring that feeds it
+static dq_ring wrRing;
+static pthread_t wrThread;
+static sem_t wrSynced;
+
+// Datagrams the kernel dropped on the socket as of the last message, the
+// connection is gone by the time the peer's close is seen
+static long rxDrops = 0;
+
 /*
  *  Helper function that processes the command line arguements.  Highlights
  *  how to use a very useful utility called getopt, where you pass it a
@@ -40,7 +78,23 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
     strcpy(cfg->file_name, PROG_DEF_FNAME); // default to file name test.c
     strcpy(cfg->svr_ip_addr, PROG_DEF_SVR_ADDR); // default to server IP 127.0.0.1
     
-    while ((option = getopt(argc, argv, ":p:f:a:csh")) != -1){
+    cfg->features = 0; // default to plain transfers
+    cfg->dir_name[0] = '\0';
+    cfg->fec_n = cfg->fec_k = 0; // default to no FEC
+    cfg->loss_pct = 0;
+    cfg->ack_every = DP_DEF_ACK_EVERY;
+    cfg->pace_rate = 0;
+    cfg->cookies = 0;
+    cfg->idle_secs = 0;
+    cfg->sock_buf_max = DP_SOCKBUF_MAX;
+    cfg->busy_poll_us = 0;
+    cfg->zero_copy = 0;
+    cfg->no_gso = 0;
+    cfg->gro = 0;
+    cfg->no_shm = 0;
+    cfg->unix_path[0] = '\0';
+
+    while ((option = getopt(argc, argv, ":p:f:a:d:e:l:k:t:i:b:u:U:cszrqmvxngLh")) != -1){
         switch(option) {
             case 'p':
                 strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
@@ -58,12 +112,89 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
             case 's':
                 cfg->prog_mode = PROG_MD_SVR;
                 break;
+            case 'z':
+                cfg->features |= FTP_FT_COMPRESS;
+                break;
+            case 'r':
+                cfg->features |= FTP_FT_DELTA;
+                break;
+            case 'q':
+                cfg->features |= FTP_FT_RPC;
+                break;
+            case 'm':
+                cfg->features |= FTP_FT_STREAMS | FTP_FT_BATCH;
+                break;
+            case 'd':
+                strncpy(cfg->dir_name, optarg, sizeof(cfg->dir_name) - 1);
+                cfg->features |= FTP_FT_BATCH;
+                break;
+            case 'e':
+                if (sscanf(optarg, "%d:%d", &cfg->fec_n, &cfg->fec_k) != 2) {
+                    perror("FEC must be given as n:k");
+                    exit(-1);
+                }
+                break;
+            case 'l':
+                cfg->loss_pct = atoi(optarg);
+                break;
+            case 'k':
+                cfg->ack_every = atoi(optarg);
+                break;
+            case 't':
+                cfg->pace_rate = (strcmp(optarg, "auto") == 0) ? DP_PACE_AUTO : atol(optarg);
+                break;
+            case 'v':
+                cfg->cookies = 1;
+                break;
+            case 'i':
+                cfg->idle_secs = atoi(optarg);
+                break;
+            case 'b':
+                cfg->sock_buf_max = atoi(optarg);
+                break;
+            case 'u':
+                cfg->busy_poll_us = atoi(optarg);
+                break;
+            case 'x':
+                cfg->zero_copy = 1;
+                break;
+            case 'n':
+                cfg->no_gso = 1;
+                break;
+            case 'g':
+                cfg->gro = 1;
+                break;
+            case 'L':
+                cfg->no_shm = 1;
+                break;
+            case 'U':
+                strncpy(cfg->unix_path, optarg, sizeof(cfg->unix_path) - 1);
+                break;
             case 'h':
-                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-s] [-c] [-h]\n", argv[0]);
+                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-s] [-c] [-z] [-r] [-q] [-m] [-d dir] [-e n:k] [-l pct] [-k n] [-t rate] [-v] [-i secs] [-b bytes] [-u usecs] [-x] [-n] [-g] [-L] [-U path] [-h] [files...]\n", argv[0]);
                 printf("WHERE:\n\t[-c] runs in client mode, [-s] runs in server mode; DEFAULT= client_mode\n");
                 printf("\t[-a svr_addr] specifies the servers IP address as a string; DEFAULT = %s\n", cfg->svr_ip_addr);
                 printf("\t[-p portnum] specifies the port number; DEFAULT = %d\n", cfg->port_number);
                 printf("\t[-f fname] specifies the filename to send or recv; DEFAULT = %s\n", cfg->file_name);
+                printf("\t[-z] client asks the server to compress file blocks; DEFAULT = off\n");
+                printf("\t[-r] client only sends what changed if the server has a copy; DEFAULT = off\n");
+                printf("\t[-q] client asks for the size and hash of the server's copies instead of sending; DEFAULT = off\n");
+                printf("\t[-m] client sends up to %d files at once, each on its own stream; DEFAULT = off\n", FTP_STREAMS);
+                printf("\t[-d dir] client sends the whole directory tree in one session\n");
+                printf("\t[files...] client sends these files too, all in one session\n");
+                printf("\t[-e n:k] protect every n datagrams sent with k parity datagrams; DEFAULT = off\n");
+                printf("\t[-l pct] simulate losing pct percent of the data datagrams sent; DEFAULT = 0\n");
+                printf("\t[-k n] ACK received fragments n at a time; DEFAULT = %d\n", cfg->ack_every);
+                printf("\t[-t rate] pace sends at rate bytes/sec, or \"auto\" to follow the measured rate; DEFAULT = off\n");
+                printf("\t[-v] server only keeps state for clients that echo a handshake cookie; DEFAULT = off\n");
+                printf("\t[-i secs] drop the connection after secs without hearing from the peer, keepalives go out at a third of that; DEFAULT = off\n");
+                printf("\t[-b bytes] grow the socket buffers up to bytes as the link is measured, 0 keeps the kernel's; DEFAULT = %d\n", cfg->sock_buf_max);
+                printf("\t[-u usecs] busy poll the socket for usecs before sleeping, costs a core (try %d); DEFAULT = off\n", DP_BUSY_POLL_DEF_US);
+                printf("\t[-x] send messages of %d bytes and more with MSG_ZEROCOPY; DEFAULT = off\n", DP_ZC_MIN_SZ);
+                printf("\t[-n] send datagram by datagram, without UDP segmentation offload; DEFAULT = offload where the kernel has it\n");
+                printf("\t[-g] take runs of datagrams from the socket at once (UDP_GRO), for the receiving side; DEFAULT = off\n");
+                printf("\t[-L] stay on UDP when client and server are on the same host; DEFAULT = shared memory\n");
+                printf("\t[-U path] run over the local AF_UNIX socket path instead of UDP, -a and -p are not used; DEFAULT = UDP\n");
                 printf("\t[-h] displays what you are looking at now - the help\n\n");
                 exit(0);
             case ':':
@@ -75,18 +206,753 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
                 exit(-1);
         }
     }
+
+    // Any other arguments are extra files for a batch transfer
+    cfg->batch_files = argv + optind;
+    cfg->batch_count = argc - optind;
+    if (cfg->batch_count > 0)
+        cfg->features |= FTP_FT_BATCH;
+
     return cfg->prog_mode;
 }
 
-int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_sz){
-    int rcvSz;
+/*
+ * Adds len bytes at ptr to the message being built, bytes that directly
+   follow the previous piece just extend it
+*/
+static void ftp_add_iov(const void *ptr, int len){
+    if (len == 0)
+        return;
+    if (sIovCnt > 0 && (char *)sIov[sIovCnt - 1].iov_base + sIov[sIovCnt - 1].iov_len == ptr) {
+        sIov[sIovCnt - 1].iov_len += len;
+        return;
+    }
+    sIov[sIovCnt].iov_base = (void *)ptr;
+    sIov[sIovCnt].iov_len = len;
+    sIovCnt++;
+}
 
-    // open the file
-    FILE *f = fopen(full_file_path, "wb+"); // write binary & overwrite
-    if(f == NULL){
-        printf("ERROR:  Cannot open file %s\n", full_file_path);
-        exit(-1);
+/*
+ * Stages the header of a record and returns where its payload goes in
+   sStage.  With staged set the payload is expected right there and is
+   part of the message already, otherwise the caller adds it.
+*/
+static char *ftp_add_hdr(int mtype, int flags, int data_sz, int64_t raw_sz, bool staged){
+    ftp_pdu pdu = {0};
+    char *hdr = sStage + sStageSz;
+
+    pdu.proto_ver = FTP_PROTO_VER_1;
+    pdu.mtype = mtype;
+    pdu.flags = flags;
+    pdu.data_sz = data_sz;
+    pdu.raw_sz = raw_sz;
+    pdu.err_num = FTP_NO_ERROR;
+
+    memcpy(hdr, &pdu, sizeof(ftp_pdu));
+    ftp_add_iov(hdr, sizeof(ftp_pdu) + (staged ? data_sz : 0));
+    sStageSz += sizeof(ftp_pdu) + (staged ? data_sz : 0);
+    sMsgSz += sizeof(ftp_pdu) + data_sz;
+    return hdr + sizeof(ftp_pdu);
+}
+
+/*
+ * Sends every record queued so far as a single message, gathered from
+   the stage and the file data it points at
+*/
+static int ftp_flush(dp_connp dpc){
+    ssize_t rc;
+
+    if (sMsgSz == 0)
+        return FTP_NO_ERROR;
+    rc = dpsendv(dpc, sIov, sIovCnt);
+    sMsgSz = sStageSz = sIovCnt = sRefs = 0;
+    return (rc < 0) ? (int)rc : FTP_NO_ERROR;
+}
+
+/*
+ * Makes sure a record with data_sz bytes of payload fits in the message
+   being built, flushing the message first if it does not
+*/
+static int ftp_room(dp_connp dpc, int data_sz){
+    if (sMsgSz + sizeof(ftp_pdu) + data_sz > FTP_MSG_SZ || sIovCnt + 2 > FTP_MSG_IOV)
+        return ftp_flush(dpc);
+    return FTP_NO_ERROR;
+}
+
+/*
+ * Queues a record behind the ones already waiting to be sent, small
+   records end up sharing a message (and its datagrams).  The pending
+   message is flushed first if the new record would not fit.
+ * The payload is copied into the stage, so data may be reused as soon
+   as this returns.
+*/
+static int ftp_queue_rec(dp_connp dpc, int mtype, int flags, 
+                            const void *data, int data_sz, int64_t raw_sz){
+    int rc = ftp_room(dpc, data_sz);
+
+    if (rc != FTP_NO_ERROR)
+        return rc;
+    char *payload = ftp_add_hdr(mtype, flags, data_sz, raw_sz, true);
+    if (data_sz > 0)
+        memcpy(payload, data, data_sz);
+    return FTP_NO_ERROR;
+}
+
+/*
+ * Same as ftp_queue_rec(), but the payload is sent from data itself,
+   which has to stay in place until the message is flushed
+*/
+static int ftp_queue_ref(dp_connp dpc, int mtype, int flags, 
+                            const void *data, int data_sz, int64_t raw_sz){
+    int rc = ftp_room(dpc, data_sz);
+
+    if (rc != FTP_NO_ERROR)
+        return rc;
+    ftp_add_hdr(mtype, flags, data_sz, raw_sz, false);
+    ftp_add_iov(data, data_sz);
+    sRefs++;
+    return FTP_NO_ERROR;
+}
+
+/*
+ * Queues up to FTP_BLOCK_SZ bytes of file data as a DATA record,
+   compressed when that was negotiated and the block actually shrinks.
+ * A compressed block is written straight into the stage behind its
+   header, a raw one of at least FTP_REF_SZ bytes is sent from data,
+   which must stay mapped until the message is flushed.
+*/
+static int ftp_queue_data(dp_connp dpc, int features, const void *data, int data_sz){
+    int zSz = DZ_NO_GAIN;
+    int rc = ftp_room(dpc, data_sz);
+
+    if (rc != FTP_NO_ERROR)
+        return rc;
+
+    if (features & FTP_FT_COMPRESS)
+        zSz = dzcompress(&zStream, data, data_sz, 
+                            sStage + sStageSz + sizeof(ftp_pdu), data_sz);
+
+    if (zSz > 0) {
+        ftp_add_hdr(FTP_MT_DATA, FTP_FL_COMPRESSED, zSz, data_sz, true);
+        return FTP_NO_ERROR;
+    }
+    if (data_sz >= FTP_REF_SZ)
+        return ftp_queue_ref(dpc, FTP_MT_DATA, 0, data, data_sz, data_sz);
+    return ftp_queue_rec(dpc, FTP_MT_DATA, 0, data, data_sz, data_sz);
+}
+
+/*
+ * Returns the next record from the peer, receiving a new message
+   once every record of the current one has been handed out.
+ * On success pdu holds the header and payload points at its data.
+*/
+static int ftp_next_rec(dp_connp dpc, ftp_pdu *pdu, char **payload){
+    ssize_t rcvSz;
+
+    while (rMsgOff + (int)sizeof(ftp_pdu) > rMsgSz) {
+        rcvSz = dprecv(dpc, rBigBuffer, sizeof(rBigBuffer));
+        if (rcvSz < 0)
+            return (int)rcvSz;
+        rxDrops = dprxdrops(dpc);
+        rMsgSz = rcvSz;
+        rMsgOff = 0;
+    }
+
+    memcpy(pdu, rBigBuffer + rMsgOff, sizeof(ftp_pdu));
+    if (pdu->data_sz < 0 || rMsgOff + sizeof(ftp_pdu) + pdu->data_sz > rMsgSz) {
+        printf("ERROR: Truncated du-ftp record\n");
+        rMsgOff = rMsgSz;
+        return FTP_ERROR_PROTOCOL;
+    }
+    *payload = rBigBuffer + rMsgOff + sizeof(ftp_pdu);
+    rMsgOff += sizeof(ftp_pdu) + pdu->data_sz;
+    return FTP_NO_ERROR;
+}
+
+/*
+ * The server's writer thread, carries out the jobs in the ring in order.
+ * A failed write is reported once per file, the client has long moved on.
+*/
+static void *ftp_writer(void *arg){
+    ftp_wr_job *job;
+    FILE *bad = NULL;
+    int op;
+
+    do {
+        job = dqpeek(&wrRing);
+        op = job->op;
+        switch (op) {
+            case FTP_WR_DATA:
+                if (fwrite(job->data, 1, job->data_sz, job->f) != job->data_sz && job->f != bad) {
+                    perror("ERROR: Cannot write file data");
+                    bad = job->f;
+                }
+                break;
+            case FTP_WR_CLOSE:
+            case FTP_WR_RENAME:
+            case FTP_WR_DISCARD:
+                if (fclose(job->f) != 0 || job->f == bad) {
+                    if (job->data_sz > 0)
+                        printf("ERROR: File %s is incomplete\n", job->data);
+                    else
+                        printf("ERROR: A file is incomplete\n");
+                }
+                bad = NULL;
+                if (op == FTP_WR_DISCARD) {
+                    remove(job->data);
+                    break;
+                }
+                if (op == FTP_WR_RENAME) {
+                    char *to = job->data + strlen(job->data) + 1;
+                    if (rename(job->data, to) != 0) {
+                        printf("ERROR: Cannot rename %s to %s\n", job->data, to);
+                        break;
+                    }
+                    printf("File received %s\n", to);
+                } else if (job->data_sz > 0) {
+                    printf("File received %s\n", job->data);
+                }
+                break;
+            case FTP_WR_SYNC:
+                sem_post(&wrSynced);
+                break;
+        }
+        dqpop(&wrRing);
+    } while (op != FTP_WR_STOP);
+    return NULL;
+}
+
+static int ftp_wr_start(){
+    if (dqinit(&wrRing, sizeof(ftp_wr_job), FTP_WR_SLOTS) != DQ_NO_ERROR)
+        return FTP_ERROR_FILE;
+    sem_init(&wrSynced, 0, 0);
+    if (pthread_create(&wrThread, NULL, ftp_writer, NULL) != 0) {
+        perror("Cannot start the writer thread");
+        dqdestroy(&wrRing);
+        return FTP_ERROR_FILE;
+    }
+    return FTP_NO_ERROR;
+}
+
+/*
+ * Queues a job for the writer, a and b are NUL terminated strings that
+   go into its data
+*/
+static void ftp_wr_job_add(int op, FILE *f, const char *a, const char *b){
+    ftp_wr_job *job = dqreserve(&wrRing);
+
+    job->op = op;
+    job->f = f;
+    job->data_sz = 0;
+    job->data[0] = '\0';
+    if (a != NULL) {
+        job->data_sz = snprintf(job->data, sizeof(job->data), "%s", a) + 1;
+        if (b != NULL)
+            job->data_sz += snprintf(job->data + job->data_sz, sizeof(job->data) - job->data_sz, "%s", b) + 1;
+    }
+    dqpush(&wrRing);
+}
+
+/*
+ * Waits until the writer has carried out every job queued so far
+*/
+static void ftp_wr_sync(){
+    ftp_wr_job_add(FTP_WR_SYNC, NULL, NULL, NULL);
+    while (sem_wait(&wrSynced) != 0 && errno == EINTR)
+        ;
+}
+
+static void ftp_wr_stop(){
+    ftp_wr_job_add(FTP_WR_STOP, NULL, NULL, NULL);
+    pthread_join(wrThread, NULL);
+    sem_destroy(&wrSynced);
+    dqdestroy(&wrRing);
+}
+
+/*
+ * Hands file data on the server to the writer thread, keeping a running
+   hash of the file for the delta mode check at EOF.  The data is copied
+   into the ring, the receive buffer it came from is reused right away.
+*/
+static int ftp_write(ftp_session *ss, const void *data, int data_sz){
+    ftp_wr_job *job;
+    int n;
+
+    if (ss->skip)
+        return FTP_NO_ERROR;
+    if (ss->f == NULL)
+        return FTP_ERROR_PROTOCOL;
+    ss->hash = ddstrong(ss->hash, data, data_sz);
+    for (int off = 0; off < data_sz; off += n) {
+        n = (data_sz - off > FTP_BLOCK_SZ) ? FTP_BLOCK_SZ : data_sz - off;
+        job = dqreserve(&wrRing);
+        job->op = FTP_WR_DATA;
+        job->f = ss->f;
+        job->data_sz = n;
+        memcpy(job->data, (const char *)data + off, n);
+        dqpush(&wrRing);
+    }
+    return FTP_NO_ERROR;
+}
+
+/*
+ * Opens the file the server is about to receive.
+ * In delta mode an existing copy of at least one block is kept as the
+   basis, the new file is rebuilt next to it and the signatures of the
+   basis are queued for the client (an empty SIGS when there is none).
+   Otherwise the file is simply overwritten.
+*/
+static int ftp_server_open(dp_connp dpc, ftp_session *ss, const char *path){
+    static char block[DD_BLOCK_SZ];
+    static dd_sig sigs[FTP_SIGS_PER_REC];
+    int nBlocks = 0, nSigs = 0, rc;
+    struct stat st;
+
+    strncpy(ss->path, path, sizeof(ss->path) - 1);
+    ss->hash = DD_STRONG_INIT;
+    ss->skip = false;
+
+    // An earlier copy of the file may still be on its way to the disk
+    if (ss->features & FTP_FT_DELTA)
+        ftp_wr_sync();
+
+    if ((ss->features & FTP_FT_DELTA) && stat(ss->path, &st) == 0 && 
+            st.st_size >= DD_BLOCK_SZ && (ss->basis = fopen(ss->path, "rb")) != NULL) {
+        snprintf(ss->tmp_path, sizeof(ss->tmp_path), "%s.dutmp", ss->path);
+        ss->f = fopen(ss->tmp_path, "wb");
+        if (ss->f != NULL) {
+            nBlocks = st.st_size / DD_BLOCK_SZ;
+        } else {
+            fclose(ss->basis);
+            ss->basis = NULL;
+        }
+    }
+
+    if (ss->f == NULL) {
+        ss->f = fopen(ss->path, "wb+"); // write binary & overwrite
+        if (ss->f == NULL) {
+            printf("ERROR:  Cannot open file %s\n", ss->path);
+            if (!(ss->features & FTP_FT_BATCH))
+                exit(-1);
+            ss->skip = true;
+        }
+    }
+
+    if (!(ss->features & FTP_FT_DELTA))
+        return FTP_NO_ERROR;
+    if (nBlocks == 0)
+        return ftp_queue_rec(dpc, FTP_MT_SIGS, 0, NULL, 0, 0);
+
+    // Only whole blocks get a signature, the tail is always sent as data
+    rc = FTP_NO_ERROR;
+    for (int i = 0; i < nBlocks && rc == FTP_NO_ERROR; i++) {
+        if (fread(block, 1, DD_BLOCK_SZ, ss->basis) != DD_BLOCK_SZ)
+            return FTP_ERROR_FILE;
+        sigs[nSigs].weak = ddweak(block, DD_BLOCK_SZ);
+        sigs[nSigs].strong = ddstrong(DD_STRONG_INIT, block, DD_BLOCK_SZ);
+        if (++nSigs == FTP_SIGS_PER_REC || i == nBlocks - 1) {
+            rc = ftp_queue_rec(dpc, FTP_MT_SIGS, 0, sigs, nSigs * sizeof(dd_sig), nBlocks);
+            nSigs = 0;
+        }
+    }
+    return rc;
+}
+
+/*
+ * Server side of HELLO.
+ * Outside of batch mode the one file named on the server's command
+   line is opened right away and anything it needs to send back rides
+   along with the HELLOACK.
+*/
+static int ftp_server_hello(dp_connp dpc, ftp_session *ss, int features){
+    int rc;
+
+    ss->features = features & FTP_FT_SUPPORTED;
+    if (!(ss->features & FTP_FT_BATCH))
+        ss->features &= ~FTP_FT_STREAMS;
+    if (ss->features & FTP_FT_STREAMS)
+        ss->features &= ~(FTP_FT_COMPRESS | FTP_FT_DELTA);
+    if (ss->features & FTP_FT_COMPRESS)
+        dzinit(&zStream);
+
+    rc = ftp_queue_rec(dpc, FTP_MT_HELLOACK, ss->features, NULL, 0, 0);
+    if (rc == FTP_NO_ERROR && !(ss->features & (FTP_FT_BATCH | FTP_FT_RPC)))
+        rc = ftp_server_open(dpc, ss, full_file_path);
+    if (rc == FTP_NO_ERROR)
+        rc = ftp_flush(dpc);
+    return rc;
+}
+
+/*
+ * Creates every missing directory leading up to path
+*/
+static int ftp_mkdirs(const char *path){
+    char dir[FPATH_SZ];
+
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    for (char *p = dir + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+            return FTP_ERROR_FILE;
+        *p = '/';
+    }
+    return FTP_NO_ERROR;
+}
+
+/*
+ * A name from the client must stay inside the server's directory,
+   so absolute paths and ".." components are refused
+*/
+static bool ftp_bad_name(const char *name, int name_sz){
+    return name_sz <= 1 || name[name_sz - 1] != '\0' || name[0] == '/' ||
+            strcmp(name, "..") == 0 || strncmp(name, "../", 3) == 0 ||
+            strstr(name, "/../") != NULL ||
+            (name_sz > 3 && strcmp(name + name_sz - 4, "/..") == 0);
+}
+
+/*
+ * Server side of FILE in batch mode
+*/
+static int ftp_server_file(dp_connp dpc, ftp_session *ss, char *payload, int data_sz){
+    char path[FPATH_SZ];
+    int rc;
+
+    if (!(ss->features & FTP_FT_BATCH) || ss->f != NULL)
+        return FTP_ERROR_PROTOCOL;
+    if (ftp_bad_name(payload, data_sz)) {
+        printf("ERROR: Refusing file name %.*s\n", data_sz, payload);
+        ss->skip = true;
+        // The client waits for signatures before it sends the data
+        if ((ss->features & FTP_FT_DELTA) &&
+                ((rc = ftp_queue_rec(dpc, FTP_MT_SIGS, 0, NULL, 0, 0)) != FTP_NO_ERROR ||
+                 (rc = ftp_flush(dpc)) != FTP_NO_ERROR))
+            return rc;
+        return FTP_ERROR_FILE;
+    }
+
+    snprintf(path, sizeof(path), "./infile/%s", payload);
+    if (ftp_mkdirs(path) != FTP_NO_ERROR)
+        printf("ERROR:  Cannot create directories for %s\n", path);
+    rc = ftp_server_open(dpc, ss, path);
+    if (rc == FTP_NO_ERROR && (ss->features & FTP_FT_DELTA))
+        rc = ftp_flush(dpc);
+    return rc;
+}
+
+/*
+ * Copies a run of blocks out of the server's existing copy of the file
+*/
+static int ftp_server_copy(ftp_session *ss, ftp_copy *cp){
+    static char block[DD_BLOCK_SZ];
+    int rc;
+
+    if (ss->basis == NULL || cp->block < 0 || cp->count < 0)
+        return FTP_ERROR_PROTOCOL;
+    if (fseek(ss->basis, (long)cp->block * DD_BLOCK_SZ, SEEK_SET) != 0)
+        return FTP_ERROR_FILE;
+    for (int i = 0; i < cp->count; i++) {
+        if (fread(block, 1, DD_BLOCK_SZ, ss->basis) != DD_BLOCK_SZ)
+            return FTP_ERROR_FILE;
+        if ((rc = ftp_write(ss, block, DD_BLOCK_SZ)) != FTP_NO_ERROR)
+            return rc;
+    }
+    return FTP_NO_ERROR;
+}
+
+/*
+ * Server side of EOF.
+ * In delta mode the rebuilt file only replaces the existing copy if its
+   hash matches the one computed by the client.
+*/
+static int ftp_server_eof(ftp_session *ss, char *payload, int data_sz){
+    uint64_t hash;
+
+    if (ss->skip) {
+        if (ss->f != NULL)
+            ftp_wr_job_add(FTP_WR_CLOSE, ss->f, NULL, NULL);
+        ss->f = NULL;
+        ss->skip = false;
+        return FTP_NO_ERROR;
+    }
+    if (ss->f == NULL)
+        return FTP_ERROR_PROTOCOL;
+
+    // The writer closes the file once its data is out, and reports it
+    if (ss->basis == NULL) {
+        ftp_wr_job_add(FTP_WR_CLOSE, ss->f, ss->path, NULL);
+        ss->f = NULL;
+        return FTP_NO_ERROR;
+    }
+
+    fclose(ss->basis);
+    ss->basis = NULL;
+    if (data_sz == sizeof(hash))
+        memcpy(&hash, payload, sizeof(hash));
+    if (data_sz != sizeof(hash) || hash != ss->hash) {
+        printf("ERROR: Rebuilt file does not match, keeping the old copy\n");
+        ftp_wr_job_add(FTP_WR_DISCARD, ss->f, ss->tmp_path, NULL);
+        ss->f = NULL;
+        return (data_sz != sizeof(hash)) ? FTP_ERROR_PROTOCOL : FTP_ERROR_BAD_DATA;
+    }
+    ftp_wr_job_add(FTP_WR_RENAME, ss->f, ss->tmp_path, ss->path);
+    ss->f = NULL;
+    return FTP_NO_ERROR;
+}
+
+/*
+ * Handles a single record received by the server.
+ * A HELLO is answered right away with the features the server agrees to,
+   FILE starts the next file of a batch,
+   DATA records are decompressed if needed and written to the file, COPY
+   records pull blocks from the existing copy and an EOF closes the file.
+*/
+static int ftp_server_rec(dp_connp dpc, ftp_session *ss, ftp_pdu *pdu, char *payload){
+    ftp_copy cp;
+    int rc;
+
+    switch(pdu->mtype){
+        case FTP_MT_HELLO:
+            return ftp_server_hello(dpc, ss, pdu->flags);
+
+        case FTP_MT_DATA:
+            if (pdu->flags & FTP_FL_COMPRESSED) {
+                if (!(ss->features & FTP_FT_COMPRESS) || pdu->raw_sz > sizeof(zBuffer))
+                    return FTP_ERROR_PROTOCOL;
+                rc = dzdecompress(&zStream, payload, pdu->data_sz, zBuffer, (int)pdu->raw_sz);
+                if (rc < 0)
+                    return FTP_ERROR_BAD_DATA;
+                return ftp_write(ss, zBuffer, rc);
+            }
+            // Raw blocks still feed the window the compressed ones refer to
+            if (ss->features & FTP_FT_COMPRESS)
+                dzappend(&zStream, payload, pdu->data_sz);
+            return ftp_write(ss, payload, pdu->data_sz);
+
+        case FTP_MT_FILE:
+            return ftp_server_file(dpc, ss, payload, pdu->data_sz);
+
+        case FTP_MT_COPY:
+            if (pdu->data_sz != sizeof(ftp_copy))
+                return FTP_ERROR_PROTOCOL;
+            memcpy(&cp, payload, sizeof(cp));
+            return ftp_server_copy(ss, &cp);
+
+        case FTP_MT_EOF:
+            return ftp_server_eof(ss, payload, pdu->data_sz);
+
+        default:
+            printf("ERROR: Unexpected du-ftp message type %d\n", pdu->mtype);
+            return FTP_ERROR_PROTOCOL;
+    }
+}
+
+/*
+ * Size and strong hash of the file at path, returns the size of the
+   ftp_stat or FTP_ERROR_FILE
+*/
+static int ftp_file_stat(const char *path, ftp_stat *fs){
+    struct stat st;
+    unsigned char *data;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return FTP_ERROR_FILE;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return FTP_ERROR_FILE;
+    }
+    fs->size = st.st_size;
+    fs->hash = DD_STRONG_INIT;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return FTP_ERROR_FILE;
+        }
+        for (long off = 0; off < st.st_size; off += FTP_BLOCK_SZ)
+            fs->hash = ddstrong(fs->hash, data + off,
+                        (st.st_size - off > FTP_BLOCK_SZ) ? FTP_BLOCK_SZ : st.st_size - off);
+        munmap(data, st.st_size);
+    }
+    close(fd);
+    return sizeof(ftp_stat);
+}
+
+//Server side of RPC mode, the calls left for after the current turn
+typedef struct ftp_rpc_work {
+    int         count;
+    uint32_t    ids[DR_MAX_CALLS];
+    char        paths[DR_MAX_CALLS][FPATH_SZ];
+} ftp_rpc_work;
+
+/*
+ * Answers one RPC call.  Small files are hashed on the spot, large ones
+   are deferred so they do not hold up the rest of the turn.
+*/
+static int ftp_rpc_handler(dr_session *rs, uint32_t id, int method, const void *req,
+                            int req_sz, void *resp, int resp_cap, void *arg){
+    ftp_rpc_work *work = arg;
+    char path[FPATH_SZ];
+    struct stat st;
+
+    if (method != FTP_RPC_STAT || resp_cap < sizeof(ftp_stat))
+        return FTP_ERROR_PROTOCOL;
+    if (ftp_bad_name(req, req_sz)) {
+        printf("ERROR: Refusing file name %.*s\n", req_sz, (const char *)req);
+        return FTP_ERROR_FILE;
+    }
+    snprintf(path, sizeof(path), "./infile/%s", (const char *)req);
+    if (stat(path, &st) != 0)
+        return FTP_ERROR_FILE;
+
+    if (st.st_size >= FTP_RPC_DEFER_SZ && work->count < DR_MAX_CALLS) {
+        work->ids[work->count] = id;
+        strcpy(work->paths[work->count++], path);
+        return DR_DEFERRED;
+    }
+    return ftp_file_stat(path, resp);
+}
+
+/*
+ * Serves RPC calls until the client disconnects, the deferred calls of
+   every turn are answered with the next one
+*/
+static int ftp_server_rpc(dp_connp dpc){
+    dr_session rs;
+    ftp_rpc_work work = {0};
+    ftp_stat fs;
+    int rc, calls = 0;
+
+    if (drinit(&rs, dpc) != DR_NO_ERROR)
+        return FTP_ERROR_PROTOCOL;
+    while ((rc = drserve(&rs, ftp_rpc_handler, &work)) >= 0) {
+        calls += rc;
+        for (int i = 0; i < work.count; i++) {
+            int sz = ftp_file_stat(work.paths[i], &fs);
+            drreply(&rs, work.ids[i], (sz < 0) ? sz : DR_NO_ERROR, &fs, (sz < 0) ? 0 : sz);
+        }
+        work.count = 0;
+    }
+    drfree(&rs);
+    printf("Answered %d calls\n", calls);
+    return rc;
+}
+
+//Server side of streams mode, the file arriving on one stream
+typedef struct ftp_rx_stream {
+    uint32_t    sid;            //0 = slot is free
+    ftp_session ss;
+    char        hdr[sizeof(ftp_pdu) + FPATH_SZ];
+    int         hdrLen;         //bytes of the FILE record in so far
+    int64_t     left;           //file data still to come
+} ftp_rx_stream;
+
+static ftp_rx_stream rxStreams[DS_MAX_STREAMS];
+
+/*
+ * Takes one frame of a stream: the FILE record is collected first (it
+   may be split over frames), everything after it is file data
+*/
+static int ftp_stream_frame(dp_connp dpc, ftp_rx_stream *rs, char *data, int data_sz){
+    ftp_pdu pdu;
+    int n, need;
+
+    while (data_sz > 0 && rs->left < 0) {
+        need = sizeof(ftp_pdu);
+        if (rs->hdrLen >= need) {
+            memcpy(&pdu, rs->hdr, sizeof(pdu));
+            if (pdu.mtype != FTP_MT_FILE || pdu.data_sz <= 0 || pdu.data_sz > FPATH_SZ || pdu.raw_sz < 0)
+                return FTP_ERROR_PROTOCOL;
+            need += pdu.data_sz;
+        }
+        n = (need - rs->hdrLen < data_sz) ? need - rs->hdrLen : data_sz;
+        memcpy(rs->hdr + rs->hdrLen, data, n);
+        rs->hdrLen += n;
+        data += n;
+        data_sz -= n;
+        if (rs->hdrLen == need && need > sizeof(ftp_pdu)) {
+            rs->left = pdu.raw_sz;
+            ftp_server_file(dpc, &rs->ss, rs->hdr + sizeof(ftp_pdu), pdu.data_sz);
+        }
+    }
+    if (data_sz == 0)
+        return FTP_NO_ERROR;
+    if (data_sz > rs->left)
+        return FTP_ERROR_PROTOCOL;
+    rs->left -= data_sz;
+    return ftp_write(&rs->ss, data, data_sz);
+}
+
+/*
+ * Receives files on as many streams as the client sends at once
+   until it disconnects
+*/
+static int ftp_server_streams(dp_connp dpc, int features){
+    static ds_conn ds;
+    ftp_rx_stream *rs;
+    uint32_t sid;
+    char *data;
+    int rc, fin;
+
+    if (dsinit(&ds, dpc) != DS_NO_ERROR)
+        return FTP_ERROR_PROTOCOL;
+    while (1) {
+        rc = dsrecv(&ds, &sid, &data, &fin);
+        if (rc == DP_CONNECTION_CLOSED || rc == DP_ERROR_TIMEOUT)
+            break;
+        if (rc < 0) {
+            printf("ERROR: Bad stream frame, error %d\n", rc);
+            continue;
+        }
+        rs = NULL;
+        for (int i = 0; i < DS_MAX_STREAMS && rs == NULL; i++)
+            if (rxStreams[i].sid == sid)
+                rs = &rxStreams[i];
+        for (int i = 0; i < DS_MAX_STREAMS && rs == NULL; i++) {
+            if (rxStreams[i].sid != 0)
+                continue;
+            rs = &rxStreams[i];
+            bzero(rs, sizeof(ftp_rx_stream));
+            rs->sid = sid;
+            rs->ss.features = features;
+            rs->left = -1;
+        }
+        if (rs == NULL)
+            continue;
+
+        if (ftp_stream_frame(dpc, rs, data, rc) != FTP_NO_ERROR && !rs->ss.skip) {
+            printf("ERROR: Bad data on stream %u, dropping its file\n", sid);
+            rs->ss.skip = true;
+        }
+        if (!fin)
+            continue;
+        if (rs->left != 0 && !rs->ss.skip)
+            printf("ERROR: Stream %u ended %lld bytes short\n", sid, (long long)rs->left);
+        if (rs->ss.f == NULL && !rs->ss.skip)
+            printf("ERROR: Stream %u ended without a file\n", sid);
+        else
+            ftp_server_eof(&rs->ss, NULL, 0);
+        rs->sid = 0;
+    }
+
+    for (int i = 0; i < DS_MAX_STREAMS; i++) {
+        if (rxStreams[i].sid != 0 && rxStreams[i].ss.f != NULL)
+            ftp_wr_job_add(FTP_WR_CLOSE, rxStreams[i].ss.f, NULL, NULL);
+        rxStreams[i].sid = 0;
     }
+    dsfree(&ds);
+    return rc;
+}
+
+int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_sz){
+    int rc;
+    ftp_session ss = {0};
+    ftp_pdu pdu;
+    char *payload;
+
     if (dpc->isConnected == false){
         perror("Expecting the protocol to be in connect state, but its not");
         exit(-1);
@@ -94,61 +960,608 @@ int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_
     //Loop until a disconnect is received, or error hapens
     while(1) {
 
-        //receive request from client
-        rcvSz = dprecv(dpc, rBuff, rbuff_sz); // waiting for stuff from the client (neg. is error, pos. is # of bytes)
-        if (rcvSz == DP_CONNECTION_CLOSED){
-            fclose(f);
+        //receive the next record from the client (neg. is error)
+        rc = ftp_next_rec(dpc, &pdu, &payload);
+        if (rc == DP_CONNECTION_CLOSED){
+            if (ss.f != NULL)
+                ftp_wr_job_add(FTP_WR_CLOSE, ss.f, NULL, NULL);
+            if (ss.basis != NULL)
+                fclose(ss.basis);
+            if (rxDrops > 0)
+                printf("Kernel dropped %ld datagrams on the socket\n", rxDrops);
             printf("Client closed connection\n");
             return DP_CONNECTION_CLOSED;
         }
-        fwrite(rBuff, 1, rcvSz, f);
+        if (rc == DP_ERROR_TIMEOUT) {
+            if (ss.f != NULL)
+                ftp_wr_job_add(FTP_WR_CLOSE, ss.f, NULL, NULL);
+            if (ss.basis != NULL)
+                fclose(ss.basis);
+            printf("Client timed out\n");
+            return DP_ERROR_TIMEOUT;
+        }
+        if (rc != FTP_NO_ERROR) {
+            printf("ERROR: Receive failed with %d\n", rc);
+            continue;
+        }
+
+        rc = ftp_server_rec(dpc, &ss, &pdu, payload);
+        if (rc != FTP_NO_ERROR)
+            printf("ERROR: Could not process du-ftp record, error %d\n", rc);
+
+        // RPC and streams sessions leave the record protocol after their HELLO
+        if (pdu.mtype == FTP_MT_HELLO && (ss.features & (FTP_FT_RPC | FTP_FT_STREAMS))) {
+            if (ss.features & FTP_FT_RPC)
+                rc = ftp_server_rpc(dpc);
+            else
+                rc = ftp_server_streams(dpc, ss.features);
+            printf((rc == DP_ERROR_TIMEOUT) ? "Client timed out\n" : "Client closed connection\n");
+            return rc;
+        }
+    }
+
+}
+
+/*
+ * Client side of delta mode.
+ * Slides a DD_BLOCK_SZ window over the file, whenever the window matches
+   one of the server's blocks the literal bytes before it are queued as
+   DATA and the block is queued as (or merged into) a COPY run.
+ * data is the file mapped in memory.
+*/
+static int ftp_client_delta(dp_connp dpc, int features, const unsigned char *data, 
+                                long size, dd_table *tbl){
+    ftp_copy run = {0, 0};
+    long off = 0, litStart = 0;
+    uint32_t weak = 0;
+    int idx, rc = FTP_NO_ERROR;
+
+    if (size >= DD_BLOCK_SZ)
+        weak = ddweak(data, DD_BLOCK_SZ);
+
+    while (off + DD_BLOCK_SZ <= size && rc == FTP_NO_ERROR) {
+        idx = ddtable_find(tbl, weak, data + off);
+        if (idx < 0) {
+            if (off + DD_BLOCK_SZ < size)
+                weak = ddroll(weak, data[off], data[off + DD_BLOCK_SZ], DD_BLOCK_SZ);
+            off++;
+            continue;
+        }
 
-        // File chunk printing is no longer useful
-        // Because the whole file will be read in dprecv()
+        // Literal bytes in between end the current run of blocks
+        if (litStart < off && run.count > 0) {
+            rc = ftp_queue_rec(dpc, FTP_MT_COPY, 0, &run, sizeof(run), 0);
+            run.count = 0;
+        }
+        while (litStart < off && rc == FTP_NO_ERROR) {
+            int n = (off - litStart > FTP_BLOCK_SZ) ? FTP_BLOCK_SZ : off - litStart;
+            rc = ftp_queue_data(dpc, features, data + litStart, n);
+            litStart += n;
+        }
 
-        // rcvSz = rcvSz > 50 ? 50 : rcvSz;    //Just print the first 50 characters max
+        if (run.count > 0 && idx == run.block + run.count) {
+            run.count++;
+        } else {
+            if (run.count > 0 && rc == FTP_NO_ERROR)
+                rc = ftp_queue_rec(dpc, FTP_MT_COPY, 0, &run, sizeof(run), 0);
+            run.block = idx;
+            run.count = 1;
+        }
 
-        // printf("========================> \n%.*s\n========================> \n", 
-        //     rcvSz, (char *)rBuff);
+        off += DD_BLOCK_SZ;
+        litStart = off;
+        if (off + DD_BLOCK_SZ <= size)
+            weak = ddweak(data + off, DD_BLOCK_SZ);
     }
 
+    if (run.count > 0 && rc == FTP_NO_ERROR)
+        rc = ftp_queue_rec(dpc, FTP_MT_COPY, 0, &run, sizeof(run), 0);
+    while (litStart < size && rc == FTP_NO_ERROR) {
+        int n = (size - litStart > FTP_BLOCK_SZ) ? FTP_BLOCK_SZ : size - litStart;
+        rc = ftp_queue_data(dpc, features, data + litStart, n);
+        litStart += n;
+    }
+
+    return rc;
 }
 
+/*
+ * Collects the block signatures the server sends for a file and builds
+   the lookup table over them, the table is left empty if the server does
+   not have a copy of the file or sent a record of partial signatures
+*/
+static int ftp_client_sigs(dp_connp dpc, dd_table *tbl){
+    dd_sig *sigs = NULL;
+    long got = 0, want = -1;
+    bool torn = false;
+    int rc;
+    ftp_pdu pdu;
+    char *payload;
 
+    while (got != want) {
+        rc = ftp_next_rec(dpc, &pdu, &payload);
+        if (rc != FTP_NO_ERROR)
+            return rc;
+        if (pdu.mtype == FTP_MT_SIGS && pdu.raw_sz == 0 && want < 0)
+            break;  // the server has no copy of this file
+        if (pdu.mtype != FTP_MT_SIGS || pdu.raw_sz <= 0 || 
+                (want >= 0 && pdu.raw_sz * (long)sizeof(dd_sig) != want) ||
+                got + pdu.data_sz > pdu.raw_sz * (long)sizeof(dd_sig)) {
+            free(sigs);
+            return FTP_ERROR_PROTOCOL;
+        }
+        if (sigs == NULL) {
+            want = pdu.raw_sz * (long)sizeof(dd_sig);
+            sigs = malloc(want);
+            if (sigs == NULL)
+                return FTP_ERROR_FILE;
+        }
+        // A record that does not hold whole signatures spoils the set,
+        // the rest of it is still read to stay in step with the server
+        if (pdu.data_sz % sizeof(dd_sig) != 0)
+            torn = true;
+        memcpy((char *)sigs + got, payload, pdu.data_sz);
+        got += pdu.data_sz;
+    }
 
-void start_client(dp_connp dpc){
+    // Without signatures the whole file goes out
+    if (torn) {
+        printf("WARNING: Bad signatures from the server, sending the whole file\n");
+        free(sigs);
+        return FTP_NO_ERROR;
+    }
+    if (ddtable_init(tbl, sigs, got / sizeof(dd_sig)) != 0) {
+        free(sigs);
+        return FTP_ERROR_FILE;
+    }
+    return FTP_NO_ERROR;
+}
 
-    // Array can now hold an entire file up to 1mil bytes
-    static char sBuff[BIG_BUFF_SZ];
+//Client side of streams mode, the file going out on one stream
+typedef struct ftp_tx_stream {
+    uint32_t        sid;        //0 = slot is free
+    unsigned char   *data;      //file mapping the stream is sent from
+    long            size;
+    char            hdr[sizeof(ftp_pdu) + FPATH_SZ];
+} ftp_tx_stream;
 
-    if(!dpc->isConnected) {
-        printf("Client not connected\n");
-        return;
+static ds_conn sDs;
+static ftp_tx_stream txStreams[FTP_STREAMS];
+
+/*
+ * Sends the next message of the streams in flight and releases the
+   files whose stream has ended.  busy is how many are still going.
+*/
+static int ftp_stream_pump(int *busy){
+    ssize_t rc = dssend(&sDs);
+
+    if (rc < 0)
+        return (int)rc;
+    *busy = 0;
+    for (int i = 0; i < FTP_STREAMS; i++) {
+        if (txStreams[i].sid == 0)
+            continue;
+        if (dsbusy(&sDs, txStreams[i].sid)) {
+            (*busy)++;
+            continue;
+        }
+        if (txStreams[i].data != NULL)
+            munmap(txStreams[i].data, txStreams[i].size);
+        txStreams[i].sid = 0;
+    }
+    return FTP_NO_ERROR;
+}
+
+/*
+ * Streams mode: puts the file on a stream of its own, waiting for one
+   of the FTP_STREAMS files in flight to finish first if need be
+*/
+static int ftp_stream_file(const char *path, const char *name){
+    ftp_tx_stream *ts = NULL;
+    ftp_pdu pdu = {0};
+    struct stat st;
+    int fd, busy, sid, rc;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || strlen(name) + 1 > FPATH_SZ) {
+        printf("ERROR:  Cannot open file %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return FTP_NO_ERROR;
+    }
+
+    while (ts == NULL) {
+        for (int i = 0; i < FTP_STREAMS && ts == NULL; i++)
+            if (txStreams[i].sid == 0)
+                ts = &txStreams[i];
+        if (ts == NULL && (rc = ftp_stream_pump(&busy)) != FTP_NO_ERROR) {
+            close(fd);
+            return rc;
+        }
+    }
+
+    ts->size = st.st_size;
+    ts->data = NULL;
+    if (ts->size > 0) {
+        ts->data = mmap(NULL, ts->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ts->data == MAP_FAILED) {
+            printf("ERROR:  Cannot map file %s\n", path);
+            close(fd);
+            return FTP_ERROR_FILE;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        madvise(ts->data, ts->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    pdu.proto_ver = FTP_PROTO_VER_1;
+    pdu.mtype = FTP_MT_FILE;
+    pdu.data_sz = strlen(name) + 1;
+    pdu.raw_sz = st.st_size;
+    memcpy(ts->hdr, &pdu, sizeof(pdu));
+    memcpy(ts->hdr + sizeof(pdu), name, pdu.data_sz);
+
+    if ((sid = dsopen(&sDs)) < 0) {
+        // The slot stays free, nothing else will unmap the file
+        if (ts->data != NULL)
+            munmap(ts->data, ts->size);
+        ts->data = NULL;
+        return FTP_ERROR_PROTOCOL;
+    }
+    ts->sid = sid;
+    if (ts->size < FTP_SMALL_SZ)
+        dssetprio(&sDs, sid, DS_PRIO_DEF - 1, 1);
+    dswrite(&sDs, sid, ts->hdr, sizeof(pdu) + pdu.data_sz);
+    dswrite(&sDs, sid, ts->data, ts->size);
+    dsclose(&sDs, sid);
+    return FTP_NO_ERROR;
+}
+
+/*
+ * Sends what is left of the files in flight
+*/
+static int ftp_stream_finish(){
+    int busy = 1, rc = FTP_NO_ERROR;
+
+    while (busy > 0 && rc == FTP_NO_ERROR)
+        rc = ftp_stream_pump(&busy);
+    return rc;
+}
+
+//Client read-ahead of the file being sent
+typedef struct ftp_ra {
+    dq_ring             ring;
+    pthread_t           thread;
+    int                 fd;
+    const unsigned char *data;
+    long                size;
+    long                blocks;     //blocks the reader hands over, always all of them
+    long                taken;      //blocks the sender has taken
+    atomic_bool         stop;       //sender gave up, hand the rest over untouched
+} ftp_ra;
+
+/*
+ * The reader thread, see Client read-ahead in du-ftp.h
+*/
+static void *ftp_reader(void *arg){
+    ftp_ra *ra = arg;
+    long page = sysconf(_SC_PAGESIZE);
+    volatile unsigned char sink = 0;
+
+    for (long off = 0; off < ra->size; off += FTP_BLOCK_SZ) {
+        long len = (ra->size - off > FTP_BLOCK_SZ) ? FTP_BLOCK_SZ : ra->size - off;
+        ftp_ra_block *b = dqreserve(&ra->ring);
+
+        if (!atomic_load(&ra->stop)) {
+            if (off + len < ra->size)
+                posix_fadvise(ra->fd, off + len, FTP_BLOCK_SZ, POSIX_FADV_WILLNEED);
+            for (long p = 0; p < len; p += page)
+                sink += ra->data[off + p];
+        }
+        b->off = off;
+        b->len = len;
+        dqpush(&ra->ring);
     }
+    (void)sink;
+    return NULL;
+}
+
+static int ftp_ra_start(ftp_ra *ra, int fd, const unsigned char *data, long size){
+    bzero(ra, sizeof(ftp_ra));
+    ra->fd = fd;
+    ra->data = data;
+    ra->size = size;
+    ra->blocks = (size + FTP_BLOCK_SZ - 1) / FTP_BLOCK_SZ;
+    atomic_init(&ra->stop, false);
+    if (dqinit(&ra->ring, sizeof(ftp_ra_block), FTP_RA_BLOCKS) != DQ_NO_ERROR)
+        return FTP_ERROR_FILE;
+    if (pthread_create(&ra->thread, NULL, ftp_reader, ra) != 0) {
+        dqdestroy(&ra->ring);
+        return FTP_ERROR_FILE;
+    }
+    return FTP_NO_ERROR;
+}
+
+/*
+ * Waits for the reader to hand over the next block
+*/
+static void ftp_ra_next(ftp_ra *ra){
+    dqpeek(&ra->ring);
+    dqpop(&ra->ring);
+    ra->taken++;
+}
+
+/*
+ * Stops the reader, the mapping can go once this returns
+*/
+static void ftp_ra_stop(ftp_ra *ra){
+    atomic_store(&ra->stop, true);
+    while (ra->taken < ra->blocks)
+        ftp_ra_next(ra);
+    pthread_join(ra->thread, NULL);
+    dqdestroy(&ra->ring);
+}
+
+/*
+ * Sends one file.  In batch mode it is announced with a FILE record
+   first, name is its path relative to the directory on both sides.
+*/
+static int ftp_client_file(dp_connp dpc, int features, const char *path, const char *name){
+    dd_table tbl = {0};
+    struct stat st;
+    unsigned char *data = NULL;
+    long size;
+    int rc = FTP_NO_ERROR;
+    ftp_ra ra;
+    bool readAhead = false;
 
+    if (features & FTP_FT_STREAMS)
+        return ftp_stream_file(path, name);
 
-    FILE *f = fopen(full_file_path, "rb");
+    FILE *f = fopen(path, "rb");
     if(f == NULL){
-        printf("ERROR:  Cannot open file %s\n", full_file_path);
+        // One unreadable file does not stop the rest of a batch
+        printf("ERROR:  Cannot open file %s\n", path);
+        return (features & FTP_FT_BATCH) ? FTP_NO_ERROR : FTP_ERROR_FILE;
+    }
+
+    // File data is sent straight from the mapping
+    if (fstat(fileno(f), &st) != 0) {
+        fclose(f);
+        return FTP_ERROR_FILE;
+    }
+    size = st.st_size;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (data == MAP_FAILED) {
+            printf("ERROR:  Cannot map file %s\n", path);
+            fclose(f);
+            return FTP_ERROR_FILE;
+        }
+        posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+
+    if (features & FTP_FT_BATCH) {
+        rc = ftp_queue_rec(dpc, FTP_MT_FILE, 0, name, strlen(name) + 1, (int64_t)st.st_size);
+        // The server answers with its signatures before the data can go
+        if (rc == FTP_NO_ERROR && (features & FTP_FT_DELTA))
+            rc = ftp_flush(dpc);
+    }
+
+    if (rc == FTP_NO_ERROR && (features & FTP_FT_DELTA))
+        rc = ftp_client_sigs(dpc, &tbl);
+
+    if (rc == FTP_NO_ERROR && tbl.count > 0) {
+        rc = ftp_client_delta(dpc, features, data, size, &tbl);
+
+        // Let the server check the file it rebuilt
+        uint64_t hash = DD_STRONG_INIT;
+        for (long off = 0; off < size; off += FTP_BLOCK_SZ)
+            hash = ddstrong(hash, data + off, (size - off > FTP_BLOCK_SZ) ? FTP_BLOCK_SZ : size - off);
+        if (rc == FTP_NO_ERROR)
+            rc = ftp_queue_rec(dpc, FTP_MT_EOF, 0, &hash, sizeof(hash), 0);
+    } else if (rc == FTP_NO_ERROR) {
+        // Send the file a block at a time, blocks that do not shrink go raw
+        if (size >= FTP_RA_MIN_SZ)
+            readAhead = (ftp_ra_start(&ra, fileno(f), data, size) == FTP_NO_ERROR);
+        for (long off = 0; off < size && rc == FTP_NO_ERROR; off += FTP_BLOCK_SZ) {
+            if (readAhead)
+                ftp_ra_next(&ra);
+            rc = ftp_queue_data(dpc, features, data + off, 
+                                (size - off > FTP_BLOCK_SZ) ? FTP_BLOCK_SZ : size - off);
+        }
+        if (rc == FTP_NO_ERROR)
+            rc = ftp_queue_rec(dpc, FTP_MT_EOF, 0, NULL, 0, 0);
+    }
+
+    // Queued records may still point into the mapping
+    if (rc == FTP_NO_ERROR && sRefs > 0)
+        rc = ftp_flush(dpc);
+    if (readAhead)
+        ftp_ra_stop(&ra);
+
+    if (data != NULL)
+        munmap(data, size);
+    free(tbl.sigs);
+    ddtable_free(&tbl);
+    fclose(f);
+    return rc;
+}
+
+/*
+ * Sends every regular file below path in batch mode,
+   name is the same directory relative to ./outfile.
+ * Symlinks to files are followed, symlinks to directories are not, one
+   pointing back up the tree would never end.
+*/
+static int ftp_client_dir(dp_connp dpc, int features, const char *path, const char *name){
+    char subPath[FPATH_SZ], subName[FPATH_SZ];
+    struct dirent *de;
+    struct stat st;
+    int rc = FTP_NO_ERROR;
+
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        printf("ERROR:  Cannot open directory %s\n", path);
+        return FTP_ERROR_FILE;
+    }
+
+    while (rc == FTP_NO_ERROR && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(subPath, sizeof(subPath), "%s/%s", path, de->d_name);
+        snprintf(subName, sizeof(subName), "%s/%s", name, de->d_name);
+        if (lstat(subPath, &st) != 0)
+            continue;
+        if (S_ISLNK(st.st_mode) && (stat(subPath, &st) != 0 || !S_ISREG(st.st_mode)))
+            continue;
+        if (S_ISDIR(st.st_mode))
+            rc = ftp_client_dir(dpc, features, subPath, subName);
+        else if (S_ISREG(st.st_mode))
+            rc = ftp_client_file(dpc, features, subPath, subName);
+    }
+
+    closedir(d);
+    return rc;
+}
+
+/*
+ * RPC mode: asks the server for the size and hash of every name.  As
+   many calls as the session allows go out together and each is printed
+   as its answer comes in, in whatever order the server finishes them.
+*/
+static int ftp_client_query(dp_connp dpc, char **names, int count){
+    dr_session rs;
+    ftp_stat fs[DR_MAX_CALLS];
+    uint32_t ids[DR_MAX_CALLS] = {0};
+    int which[DR_MAX_CALLS];
+    int next = 0, done = 0, rc, status;
+
+    if (drinit(&rs, dpc) != DR_NO_ERROR)
+        return FTP_ERROR_PROTOCOL;
+    while (done < count) {
+        for (int i = 0; i < DR_MAX_CALLS && next < count; i++) {
+            if (ids[i] != 0)
+                continue;
+            rc = drcall(&rs, FTP_RPC_STAT, names[next], strlen(names[next]) + 1, &fs[i], sizeof(ftp_stat));
+            if (rc < 0) {
+                printf("ERROR:  Cannot query %s, error %d\n", names[next++], rc);
+                done++;
+                continue;
+            }
+            ids[i] = rc;
+            which[i] = next++;
+        }
+        if (done == count)
+            break;
+
+        uint32_t id = DR_ANY;
+        if ((rc = drwait(&rs, &id, &status)) < 0) {
+            drfree(&rs);
+            return rc;
+        }
+        for (int i = 0; i < DR_MAX_CALLS; i++) {
+            if (ids[i] != id)
+                continue;
+            if (status == DR_NO_ERROR && rc == sizeof(ftp_stat))
+                printf("%s: %lld bytes, hash %016llx\n", names[which[i]],
+                        (long long)fs[i].size, (unsigned long long)fs[i].hash);
+            else
+                printf("%s: not on the server (%d)\n", names[which[i]], status);
+            ids[i] = 0;
+            done++;
+        }
+    }
+    drfree(&rs);
+    return FTP_NO_ERROR;
+}
+
+void start_client(dp_connp dpc, prog_config *cfg){
+
+    char path[FPATH_SZ];
+    int rc = FTP_NO_ERROR;
+    int features;
+    ftp_pdu pdu;
+    char *payload;
+
+    // Negotiate the features for this session, the HELLO goes out
+    // with the CONNECT so it does not cost a round trip of its own
+    ftp_queue_rec(dpc, FTP_MT_HELLO, cfg->features, NULL, 0, 0);
+    rc = dpconnectdata(dpc, sStage, sStageSz);
+    sMsgSz = sStageSz = sIovCnt = 0;
+    if (rc < 0 || !dpc->isConnected) {
+        perror("Error establishing connection");
         exit(-1);
     }
-    if (dpc->isConnected == false){
-        perror("Expecting the protocol to be in connect state, but its not");
+    rc = ftp_next_rec(dpc, &pdu, &payload);
+    if (rc != FTP_NO_ERROR || pdu.mtype != FTP_MT_HELLOACK) {
+        printf("ERROR:  Expected HELLOACK from the server\n");
+        exit(-1);
+    }
+    features = pdu.flags;
+    if ((cfg->features & FTP_FT_BATCH) && !(features & FTP_FT_BATCH)) {
+        printf("ERROR:  Server does not support batch transfers\n");
+        exit(-1);
+    }
+    if (cfg->features & FTP_FT_RPC) {
+        char *one[1] = {cfg->file_name};
+        if (!(features & FTP_FT_RPC)) {
+            printf("ERROR:  Server does not support RPC mode\n");
+            exit(-1);
+        }
+        if (cfg->batch_count > 0)
+            rc = ftp_client_query(dpc, cfg->batch_files, cfg->batch_count);
+        else
+            rc = ftp_client_query(dpc, one, 1);
+        if (rc != FTP_NO_ERROR)
+            printf("ERROR:  Query failed with %d\n", rc);
+        dpdisconnect(dpc);
+        return;
+    }
+    if (features & FTP_FT_COMPRESS)
+        dzinit(&zStream);
+    if ((features & FTP_FT_STREAMS) && dsinit(&sDs, dpc) != DS_NO_ERROR) {
+        printf("ERROR:  Cannot set up streams\n");
         exit(-1);
     }
 
-    // Now reads the entire file and sends it to dpsend()
-    int bytes = 0;
-    bytes = fread(sBuff, 1, sizeof(sBuff), f );
-    dpsend(dpc, sBuff, bytes);
+    if (features & FTP_FT_BATCH) {
+        if (cfg->dir_name[0] != '\0') {
+            snprintf(path, sizeof(path), "./outfile/%s", cfg->dir_name);
+            rc = ftp_client_dir(dpc, features, path, cfg->dir_name);
+        }
+        for (int i = 0; i < cfg->batch_count && rc == FTP_NO_ERROR; i++) {
+            snprintf(path, sizeof(path), "./outfile/%s", cfg->batch_files[i]);
+            rc = ftp_client_file(dpc, features, path, cfg->batch_files[i]);
+        }
+        if (rc == FTP_NO_ERROR && (features & FTP_FT_STREAMS)) {
+            rc = ftp_stream_finish();
+            dsfree(&sDs);
+        }
+    } else {
+        rc = ftp_client_file(dpc, features, full_file_path, cfg->file_name);
+    }
+    if (rc != FTP_NO_ERROR) {
+        printf("ERROR:  Transfer failed with %d\n", rc);
+        exit(-1);
+    }
 
-    fclose(f);
-    dpdisconnect(dpc);
+    // The last message closes the connection as well
+    if (features & FTP_FT_STREAMS)
+        dpdisconnect(dpc);
+    else
+        dpsendlastv(dpc, sIov, sIovCnt);
+    sMsgSz = sStageSz = sIovCnt = sRefs = 0;
 }
 
 void start_server(dp_connp dpc){
+    if (ftp_wr_start() != FTP_NO_ERROR)
+        exit(-1);
     // Now uses a buffer with 1mil bytes
-    server_loop(dpc, sBigBuffer, rBigBuffer, sizeof(sBigBuffer), sizeof(rBigBuffer));
+    server_loop(dpc, sStage, rBigBuffer, sizeof(sStage), sizeof(rBigBuffer));
+    // Let the writer finish before the process exits
+    ftp_wr_stop();
 }
 
 
@@ -171,21 +1584,63 @@ int main(int argc, char *argv[])
         case PROG_MD_CLI:
             //by default client will look for files in the ./outfile directory
             snprintf(full_file_path, sizeof(full_file_path), "./outfile/%s", cfg.file_name); // set the full file path
-            dpc = dpClientInit(cfg.svr_ip_addr,cfg.port_number); // IP address has to be numbers
-            rc = dpconnect(dpc); // similar to a socket
-            if (rc < 0) {
-                perror("Error establishing connection");
+            if (cfg.unix_path[0] != '\0')
+                dpc = dpClientInitUnix(cfg.unix_path);
+            else
+                dpc = dpClientInit(cfg.svr_ip_addr,cfg.port_number); // IP address has to be numbers
+            if (dpc == NULL)
+                exit(-1);
+            if (cfg.fec_n > 0 && dpsetfec(dpc, cfg.fec_n, cfg.fec_k) != DP_NO_ERROR) {
+                printf("ERROR: Bad FEC setting %d:%d\n", cfg.fec_n, cfg.fec_k);
                 exit(-1);
             }
+            dpsetloss(dpc, cfg.loss_pct);
+            dpsetackevery(dpc, cfg.ack_every);
+            dpsetpacing(dpc, cfg.pace_rate, 0);
+            dpsettimers(dpc, cfg.idle_secs * 1000 / 3, cfg.idle_secs * 1000);
+            dpsetsockbuf(dpc, cfg.sock_buf_max);
+            dpsetbusypoll(dpc, cfg.busy_poll_us);
+            if (cfg.zero_copy)
+                dpsetzerocopy(dpc, 1);
+            if (cfg.no_gso)
+                dpsetgso(dpc, 0);
+            if (cfg.gro)
+                dpsetgro(dpc, 1);
+            if (cfg.no_shm)
+                dpsetshm(dpc, 0);
 
-            start_client(dpc);
+            start_client(dpc, &cfg); // connects, similar to a socket
             exit(0);
             break;
 
         case PROG_MD_SVR:
             //by default server will look for files in the ./infile directory
             snprintf(full_file_path, sizeof(full_file_path), "./infile/%s", cfg.file_name);
-            dpc = dpServerInit(cfg.port_number); // IP address not needed
+            if (cfg.unix_path[0] != '\0')
+                dpc = dpServerInitUnix(cfg.unix_path);
+            else
+                dpc = dpServerInit(cfg.port_number); // IP address not needed
+            if (dpc == NULL)
+                exit(-1);
+            if (cfg.fec_n > 0 && dpsetfec(dpc, cfg.fec_n, cfg.fec_k) != DP_NO_ERROR) {
+                printf("ERROR: Bad FEC setting %d:%d\n", cfg.fec_n, cfg.fec_k);
+                exit(-1);
+            }
+            dpsetloss(dpc, cfg.loss_pct);
+            dpsetackevery(dpc, cfg.ack_every);
+            dpsetpacing(dpc, cfg.pace_rate, 0);
+            dpsettimers(dpc, cfg.idle_secs * 1000 / 3, cfg.idle_secs * 1000);
+            dpsetsockbuf(dpc, cfg.sock_buf_max);
+            dpsetbusypoll(dpc, cfg.busy_poll_us);
+            if (cfg.zero_copy)
+                dpsetzerocopy(dpc, 1);
+            if (cfg.no_gso)
+                dpsetgso(dpc, 0);
+            if (cfg.gro)
+                dpsetgro(dpc, 1);
+            if (cfg.no_shm)
+                dpsetshm(dpc, 0);
+            dpsetcookies(dpc, cfg.cookies);
             rc = dplisten(dpc); // starts the server and waits for a request from the client
             if (rc < 0) {
                 perror("Error establishing connection");
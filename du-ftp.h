@@ -1,37 +1,184 @@
 #pragma once
 
+#include <stdio.h>
+#include <stdint.h>
+
 #define PROG_MD_CLI     0
 #define PROG_MD_SVR     1
 #define DEF_PORT_NO     2080
 #define FNAME_SZ        128
+#define FPATH_SZ        512
 #define PROG_DEF_FNAME  "test.c"
 #define PROG_DEF_SVR_ADDR   "127.0.0.1"
 
+#define FTP_BLOCK_SZ    32768   // file data per DATA record, must not exceed DZ_BLOCK_SZ
+#define FTP_MSG_SZ      65536   // records are coalesced into messages up to this size
+#define FTP_MSG_IOV     64      // buffers a message may be gathered from
+#define FTP_REF_SZ      4096    // raw DATA payloads this large are sent from the file, not staged
+#define FTP_SIGS_PER_REC 2048   // delta signatures carried per SIGS record
+#define FTP_STREAMS     8       // files in flight at once in streams mode
+#define FTP_SMALL_SZ    (64 * 1024) // streams mode: files this small are sent ahead of larger ones
+#define FTP_WR_SLOTS    64      // server: file data queued for the writer thread, in FTP_BLOCK_SZ slots
+
 typedef struct prog_config{
     int     prog_mode;
     int     port_number;
+    int     features;
     char    svr_ip_addr[16];
     char    file_name[128];
+    char    dir_name[FNAME_SZ];     //batch mode: directory tree to send
+    char    **batch_files;          //batch mode: extra files to send
+    int     batch_count;
+    int     fec_n;                  //FEC data datagrams per group, 0 = off
+    int     fec_k;                  //FEC parity datagrams per group
+    int     loss_pct;               //simulated loss on the datagrams this side sends
+    int     ack_every;              //fragments per cumulative ACK
+    long    pace_rate;              //bytes per second this side sends at, 0 = unpaced
+    int     cookies;                //server: demand a handshake cookie
+    int     idle_secs;              //give up on a silent peer after this long, 0 = never
+    int     sock_buf_max;           //ceiling for the socket buffer tuning, 0 = kernel sizes
+    int     busy_poll_us;           //spin on the socket this long before blocking, 0 = off
+    int     zero_copy;              //send large messages with MSG_ZEROCOPY
+    int     no_gso;                 //send without UDP segmentation offload
+    int     gro;                    //receive with UDP_GRO
+    int     no_shm;                 //never use a same host link
+    char    unix_path[FNAME_SZ];    //AF_UNIX socket to run over instead of UDP, "" = UDP
 } prog_config;
 
 /*
- * PDU for the file transfer protocol
- * Can store file name, data transfer status
-   (for both sends and recieves),
-   error information (mainly for the file),
-   and the file descriptor of the file.
- * NOTE: fd can be stored by calling fileno()
-   on the FILE object, this was used as an alternative
-   to storing the entire FILE object in the PDU.
-   This way, operations on the file (such as close) can
-   be done without needing the entire FILE object.
- * NOTE TO GRADER: the README for this homework said to
-   define the PDU but nothing about implementing it.
-   Thus, this structure is not used in du-ftp.c
+ * du-ftp PDU
+ * Every message handed to dpsend() is made up of one or more records,
+   each of which starts with this header and is followed by data_sz bytes
+   of payload.
+ * The client opens a session with a HELLO carrying the features it would
+   like to use in flags, the server answers with a HELLOACK whose flags
+   hold the features it agreed to.  File data then follows in DATA records
+   and the file is finished with an EOF record.
+ * raw_sz is the size of the payload once decoded, it only differs from
+   data_sz when the record is flagged as compressed.
+ * In batch mode every file starts with a FILE record whose payload is the
+   NUL terminated path of the file relative to the server's directory and
+   whose raw_sz is the file size.  Without batch mode the server writes to
+   the name on its own command line.
+ * When delta mode is agreed to, the server answers every file with SIGS
+   records holding a dd_sig for every block of its existing copy (raw_sz
+   is the total number of signatures, a single empty SIGS record with a
+   raw_sz of 0 means there is no existing copy).  Without batch mode the
+   SIGS follow the HELLOACK.  The client then mixes DATA records
+   with COPY records that point at runs of those blocks, and its EOF
+   carries the strong hash of the whole file so the rebuilt copy can be
+   verified before it replaces the old one.
+ * When RPC mode is agreed to, the session leaves the record protocol
+   after the HELLOACK and carries du-rpc calls instead.  FTP_RPC_STAT
+   takes the NUL terminated path of a file relative to the server's
+   directory and answers with an ftp_stat.
+ * In streams mode (always a batch) every file goes on a du-stream of its
+   own, FTP_STREAMS of them at once.  The stream starts with a FILE
+   record, the file data follows as is and the end of the stream ends
+   the file.  Small files get a higher stream priority so they are not
+   held up by large ones.  Compression and delta mode are not used with
+   streams.
  */
+#define FTP_PROTO_VER_1     1
+
+#define FTP_MT_HELLO        1
+#define FTP_MT_HELLOACK     2
+#define FTP_MT_DATA         3
+#define FTP_MT_EOF          4
+#define FTP_MT_ERROR        5
+#define FTP_MT_SIGS         6
+#define FTP_MT_COPY         7
+#define FTP_MT_FILE         8
+
+//Features negotiated in the HELLO/HELLOACK flags
+#define FTP_FT_COMPRESS     1
+#define FTP_FT_DELTA        2
+#define FTP_FT_BATCH        4
+#define FTP_FT_RPC          8
+#define FTP_FT_STREAMS      16
+#define FTP_FT_SUPPORTED    (FTP_FT_COMPRESS | FTP_FT_DELTA | FTP_FT_BATCH | FTP_FT_RPC | FTP_FT_STREAMS)
+
+//RPC methods
+#define FTP_RPC_STAT        1
+#define FTP_RPC_DEFER_SZ    (1024 * 1024)   // files this large are hashed after the turn's other answers
+
+//Per record flags
+#define FTP_FL_COMPRESSED   1
+
+#define FTP_NO_ERROR        0
+#define FTP_ERROR_PROTOCOL  -1
+#define FTP_ERROR_BAD_DATA  -2
+#define FTP_ERROR_FILE      -3
+
 typedef struct ftp_pdu {
-    char    file_name[128];
-    int     data_transfer_status;
+    int     proto_ver;
+    int     mtype;
+    int     flags;
+    int     data_sz;
     int     err_num;
-    int     fd;
+    int64_t raw_sz;             //64 bit, FILE records carry the file size
 } ftp_pdu;
+
+//Payload of a COPY record, a run of blocks from the server's existing copy
+typedef struct ftp_copy {
+    int     block;
+    int     count;
+} ftp_copy;
+
+//Response to FTP_RPC_STAT
+typedef struct ftp_stat {
+    int64_t     size;
+    uint64_t    hash;           //strong hash of the whole file
+} ftp_stat;
+
+/*
+ * Server writer thread
+ * The network thread only receives, decodes and ACKs, all file writes,
+   closes and renames go through a du-queue ring to a writer thread of
+   their own, in order.  A slow disk then fills the ring instead of
+   holding up the ACKs, and only a full ring stalls the network thread.
+ * Opening a file and reading an existing copy (delta mode) stay on the
+   network thread, the latter after FTP_WR_SYNC has drained the ring.
+ */
+#define FTP_WR_DATA         1       //write data_sz bytes to f
+#define FTP_WR_CLOSE        2       //close f, data holds the path to report (if any)
+#define FTP_WR_RENAME       3       //close f and rename the two NUL terminated paths in data
+#define FTP_WR_DISCARD      4       //close f and remove the path in data
+#define FTP_WR_SYNC         5       //wake up the network thread waiting in ftp_wr_sync()
+#define FTP_WR_STOP         6
+
+typedef struct ftp_wr_job {
+    int     op;
+    FILE    *f;
+    int     data_sz;
+    char    data[FTP_BLOCK_SZ];
+} ftp_wr_job;
+
+/*
+ * Client read-ahead
+ * File data is sent straight from the file mapping, so on a cold file
+   every new page is a fault the sender sits out.  For files of at least
+   FTP_RA_MIN_SZ a reader thread walks the mapping FTP_RA_BLOCKS blocks
+   ahead of the sender, asks for the next block with POSIX_FADV_WILLNEED
+   and faults the current one in, then hands it over through a du-queue
+   ring.  The sender only waits for the disk when the reader is behind.
+ */
+#define FTP_RA_BLOCKS       4
+#define FTP_RA_MIN_SZ       (4 * FTP_BLOCK_SZ)
+
+//One block of the mapping the reader has faulted in
+typedef struct ftp_ra_block {
+    long    off;
+    long    len;
+} ftp_ra_block;
+
+//Server side state for the file being received
+typedef struct ftp_session {
+    int         features;
+    FILE        *f;             //file being written
+    FILE        *basis;         //existing copy that COPY records refer to
+    uint64_t    hash;           //strong hash of everything written so far
+    _Bool       skip;           //current file could not be opened, drop its data
+    char        path[FPATH_SZ];
+    char        tmp_path[FPATH_SZ + 8];
+} ftp_session;
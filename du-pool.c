@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "du-pool.h"
+
+/*
+ * Sits in front of every buffer, padded out to DB_ALIGN so the
+   buffer itself starts on a cache line
+*/
+struct db_hdr {
+    db_hdr      *next;          //free list link, NULL while handed out
+    db_pool     *pool;
+    int         refs;
+};
+
+#define DB_HDR_SZ   ((sizeof(db_hdr) + DB_ALIGN - 1) & ~(size_t)(DB_ALIGN - 1))
+
+static db_hdr *dbhdr(void *buf){
+    return (db_hdr *)((char *)buf - DB_HDR_SZ);
+}
+
+/*
+ * Maps the slab for count buffers of buf_sz bytes and puts all of them
+   on the free list.
+ * Without hugepages reserved, MAP_HUGETLB fails and the slab falls back
+   to normal pages that transparent hugepages may still back.
+ * Returns DB_ERROR_NOMEM if the slab cannot be mapped.
+*/
+int dbinit(db_pool *pool, int buf_sz, int count, int flags){
+    char *slab = MAP_FAILED;
+
+    bzero(pool, sizeof(db_pool));
+    if (buf_sz <= 0 || count <= 0)
+        return DB_ERROR_NOMEM;
+
+    pool->bufSz = buf_sz;
+    pool->stride = (DB_HDR_SZ + buf_sz + DB_ALIGN - 1) & ~(DB_ALIGN - 1);
+    pool->count = count;
+    pool->slabSz = (size_t)pool->stride * count;
+
+#ifdef MAP_HUGETLB
+    if (flags & DB_HUGEPAGES) {
+        size_t hugeSz = (pool->slabSz + DB_HUGEPAGE_SZ - 1) & ~(size_t)(DB_HUGEPAGE_SZ - 1);
+        slab = mmap(NULL, hugeSz, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED) {
+            pool->slabSz = hugeSz;
+            pool->huge = 1;
+        }
+    }
+#endif
+    if (slab == MAP_FAILED) {
+        slab = mmap(NULL, pool->slabSz, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            perror("dbinit: cannot map the buffer slab");
+            return DB_ERROR_NOMEM;
+        }
+#ifdef MADV_HUGEPAGE
+        if (flags & DB_HUGEPAGES)
+            madvise(slab, pool->slabSz, MADV_HUGEPAGE);
+#endif
+    }
+    pool->slab = slab;
+
+    // Thread the free list back to front so buffers go out in address order
+    for (int i = count - 1; i >= 0; i--) {
+        db_hdr *h = (db_hdr *)(slab + (size_t)i * pool->stride);
+        h->pool = pool;
+        h->refs = 0;
+        h->next = pool->free;
+        pool->free = h;
+    }
+    pool->avail = count;
+    return DB_NO_ERROR;
+}
+
+/*
+ * Unmaps the slab, buffers that are still held become invalid
+*/
+void dbdestroy(db_pool *pool){
+    if (pool->slab != NULL)
+        munmap(pool->slab, pool->slabSz);
+    bzero(pool, sizeof(db_pool));
+}
+
+/*
+ * Hands out a buffer with one reference, or NULL if the pool is empty
+*/
+void *dbget(db_pool *pool){
+    db_hdr *h = pool->free;
+
+    if (h == NULL)
+        return NULL;
+    pool->free = h->next;
+    pool->avail--;
+    h->next = NULL;
+    h->refs = 1;
+    return (char *)h + DB_HDR_SZ;
+}
+
+/*
+ * Adds a reference to a buffer that is already held
+*/
+void dbhold(void *buf){
+    dbhdr(buf)->refs++;
+}
+
+/*
+ * Drops a reference, the last one puts the buffer back on the free list
+*/
+void dbput(void *buf){
+    db_hdr *h;
+
+    if (buf == NULL)
+        return;
+    h = dbhdr(buf);
+    if (--h->refs > 0)
+        return;
+    h->next = h->pool->free;
+    h->pool->free = h;
+    h->pool->avail++;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * du-proto datagram buffer pool (db)
+ * A slab of equally sized buffers that is carved out of one mapping when
+   the pool is set up, so getting and releasing a buffer on the datagram
+   path is a pop and a push on a free list, never a malloc().
+ * With DB_HUGEPAGES the slab is mapped on hugepages (MAP_HUGETLB), or
+   marked for transparent hugepages if none are reserved, so a large pool
+   costs a handful of TLB entries instead of one per page.
+ * Every buffer carries a reference count.  dbget() hands it out with one
+   reference, dbhold() adds one for every other holder (e.g. a retransmit
+   slot next to the code that built the datagram) and the buffer goes back
+   to the free list when the last holder calls dbput().
+ * Buffers start on a DB_ALIGN boundary.  A pool is not thread safe,
+   du-proto keeps one per connection.
+ */
+#define     DB_ALIGN            64
+#define     DB_HUGEPAGE_SZ      (2 * 1024 * 1024)
+
+#define     DB_HUGEPAGES        1       //dbinit() flag: back the slab with hugepages
+
+#define     DB_NO_ERROR         0
+#define     DB_ERROR_NOMEM      -1
+
+typedef struct db_hdr db_hdr;
+
+typedef struct db_pool {
+    char        *slab;
+    size_t      slabSz;
+    int         bufSz;          //usable bytes per buffer
+    int         stride;         //header and buffer, rounded up to DB_ALIGN
+    int         count;
+    int         avail;          //buffers on the free list
+    int         huge;           //slab is on hugepages
+    db_hdr      *free;
+} db_pool;
+
+int   dbinit(db_pool *pool, int buf_sz, int count, int flags);
+void  dbdestroy(db_pool *pool);
+void *dbget(db_pool *pool);
+void  dbhold(void *buf);
+void  dbput(void *buf);
@@ -4,14 +4,27 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <sys/un.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/sock_diag.h>
+#include <sys/ioctl.h>
+#endif
 //#include <sys/time.h>
 
 #include "du-proto.h"
 
-static char _dpBuffer[DP_MAX_DGRAM_SZ];
+static char _dpBuffer[DP_UNIX_DGRAM_SZ];
 static int  _debugMode = 1;
+static dt_wheel _dpWheel;
+static bool _dpWheelInit = false;
 
 /*
  * The protocol connection will be initialized with default values and returned.
@@ -36,6 +49,26 @@ static dp_connp dpinit(){
     dpsession->seqNum = 0;
     dpsession->isConnected = false;
     dpsession->dbgMode = true;
+    dpsession->ackEvery = DP_DEF_ACK_EVERY;
+    dpsession->peerWnd = DP_DEF_RWND;
+    dpsession->lastWnd = DP_DEF_RWND;
+    dpsession->sockWnd = DP_DEF_RWND;
+    dpsession->sockBufMax = DP_SOCKBUF_MAX;
+    dpsession->rxSpace = -1;
+    dpsession->rto = DP_RTO_INIT_MS;
+    dpsession->shmSock = -1;
+    dpsession->fragSz = DP_MAX_BUFF_SZ;
+#ifdef UDP_SEGMENT
+    dpsession->gso = true;
+#endif
+    if (dbinit(&dpsession->pool, DP_MAX_DGRAM_SZ, DP_POOL_BUFS, 0) != DB_NO_ERROR) {
+        free(dpsession);
+        return NULL;
+    }
+    dtsetup(&dpsession->rtxTimer, dprtxtimer, dpsession);
+    dtsetup(&dpsession->ackTimer, dpacktimer, dpsession);
+    dtsetup(&dpsession->keepTimer, dpkeeptimer, dpsession);
+    dtsetup(&dpsession->idleTimer, dpidletimer, dpsession);
     return dpsession;
 }
 
@@ -45,6 +78,18 @@ static dp_connp dpinit(){
    connection details
 */
 void dpclose(dp_connp dpsession) {
+    dptimerstop(&dpsession->rtxTimer);
+    dptimerstop(&dpsession->ackTimer);
+    dptimerstop(&dpsession->keepTimer);
+    dptimerstop(&dpsession->idleTimer);
+    dbdestroy(&dpsession->pool);
+    free(dpsession->zcHdrs);
+    free(dpsession->groBuf);
+    dpshmdrop(dpsession);
+    if (dpsession->shmSock >= 0)
+        close(dpsession->shmSock);
+    if (dpsession->ownsPath)
+        unlink(dpsession->inSockAddr.unAddr.sun_path);
     free(dpsession);
 }
 
@@ -56,6 +101,261 @@ int  dpmaxdgram(){
     return DP_MAX_BUFF_SZ;
 }
 
+/*
+ * Turns on forward error correction for everything this side sends,
+   n data datagrams are protected by k parity datagrams.
+ * Passing n = 0 turns FEC back off.  The receiver needs no setup, it
+   reads the group layout from each PDU.
+*/
+int dpsetfec(dp_connp dp, int n, int k){
+    if (n == 0) {
+        dp->fecN = dp->fecK = 0;
+        return DP_NO_ERROR;
+    }
+    if (n < 1 || n > DP_FEC_MAX_N || k < 1 || k > DP_FEC_MAX_K)
+        return DP_ERROR_GENERAL;
+    dp->fecN = n;
+    dp->fecK = k;
+    return DP_NO_ERROR;
+}
+
+/*
+ * Sets how many fragments may be received before an ACK has to go back,
+   and how many this side sends before it waits for one.  1 ACKs every
+   datagram like the original protocol did.
+*/
+int dpsetackevery(dp_connp dp, int n){
+    if (n < 1)
+        return DP_ERROR_GENERAL;
+    dp->ackEvery = n;
+    return DP_NO_ERROR;
+}
+
+/*
+ * Paces the data this side sends at rate bytes per second, allowing
+   bursts of up to burst bytes (0 picks DP_PACE_DEF_BURST).
+ * A rate of DP_PACE_AUTO paces at the delivery rate measured from the
+   peer's ACKs, 0 turns pacing off.
+*/
+int dpsetpacing(dp_connp dp, long rate, int burst){
+    if (rate < 0 && rate != DP_PACE_AUTO)
+        return DP_ERROR_GENERAL;
+    dp->paceRate = rate;
+    dp->paceBurst = (burst > 0) ? burst : DP_PACE_DEF_BURST;
+    dp->paceTokens = dp->paceBurst;
+    dp->paceLast = dpnow();
+    return DP_NO_ERROR;
+}
+
+/*
+ * Drops roughly pct percent of the data datagrams this side
+   sends, used to try the protocol out over a lossy link
+*/
+void dpsetloss(dp_connp dp, int pct){
+    dp->dropPct = pct;
+}
+
+/*
+ * Turns on keepalives, sent after keepalive_ms without sending anything,
+   and the idle timeout, which fails the connection after idle_ms without
+   receiving anything.  0 turns either off.
+ * Keepalives only keep the peer's idle timer happy, so they should be
+   well below the peer's idle timeout.
+*/
+int dpsettimers(dp_connp dp, int keepalive_ms, int idle_ms){
+    if (keepalive_ms < 0 || idle_ms < 0)
+        return DP_ERROR_GENERAL;
+    dp->keepAliveMs = keepalive_ms;
+    dp->idleMs = idle_ms;
+    if (!keepalive_ms)
+        dptimerstop(&dp->keepTimer);
+    if (!idle_ms)
+        dptimerstop(&dp->idleTimer);
+    if (dp->isConnected)
+        dpstarttimers(dp);
+    return DP_NO_ERROR;
+}
+
+/*
+ * Sets up the datagram pool of the connection again with count buffers,
+   on hugepages if asked for (see du-pool.h).
+ * Only possible while none of the old pool's buffers are held, that is
+   outside of any dp call.
+*/
+int dpsetpool(dp_connp dp, int count, int hugepages){
+    if (count < 2 || dp->pool.avail != dp->pool.count)
+        return DP_ERROR_GENERAL;
+
+    dbdestroy(&dp->pool);
+    if (dbinit(&dp->pool, dp->fragSz + sizeof(dp_pdu), count, hugepages ? DB_HUGEPAGES : 0) == DB_NO_ERROR)
+        return DP_NO_ERROR;
+
+    // Keep the connection usable with the default pool
+    dbinit(&dp->pool, dp->fragSz + sizeof(dp_pdu), DP_POOL_BUFS, 0);
+    return DP_ERROR_GENERAL;
+}
+
+/*
+ * Switches the connection to fragments of frag_sz bytes.  The pool's
+   buffers are set up again to hold a datagram of that size if none of
+   them is held (as for dpsetpool()), larger ones than needed still do
+   when they cannot be.
+*/
+static int dpsetfrag(dp_connp dp, int frag_sz){
+    int need = frag_sz + sizeof(dp_pdu), old = dp->pool.bufSz;
+
+    if (old != need && dp->pool.avail == dp->pool.count) {
+        int count = dp->pool.count, flags = dp->pool.huge ? DB_HUGEPAGES : 0;
+        dbdestroy(&dp->pool);
+        if (dbinit(&dp->pool, need, count, flags) != DB_NO_ERROR)
+            dbinit(&dp->pool, old, DP_POOL_BUFS, 0);
+    }
+    if (dp->pool.bufSz < need)
+        return DP_ERROR_GENERAL;
+    dp->fragSz = frag_sz;
+    return DP_NO_ERROR;
+}
+
+/*
+ * Turns on busy polling, see the notes in du-proto.h, 0 turns it off.
+ * SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN, without it
+   only the spin in dprecvraw() is done.
+*/
+int dpsetbusypoll(dp_connp dp, int usecs){
+    if (usecs < 0)
+        return DP_ERROR_GENERAL;
+    dp->busyPollUs = usecs;
+#ifdef SO_BUSY_POLL
+    if (setsockopt(dp->udp_sock, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) != 0 && usecs > 0)
+        printf("dpsetbusypoll: no SO_BUSY_POLL (%s), spinning in user space only\n", strerror(errno));
+#endif
+    return DP_NO_ERROR;
+}
+
+/*
+ * Turns zero copy sends on or off, see the notes in du-proto.h.
+ * Needs SO_ZEROCOPY (Linux 4.14), without it the connection keeps
+   copying and DP_ERROR_GENERAL is returned.
+*/
+int dpsetzerocopy(dp_connp dp, int on){
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    on = on ? 1 : 0;
+    if (on && dp->zcHdrs == NULL) {
+        dp->zcHdrs = calloc(DP_ZC_HDRS, sizeof(dp_pdu));
+        if (dp->zcHdrs == NULL)
+            return DP_ERROR_GENERAL;
+    }
+    if (setsockopt(dp->udp_sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+        if (on)
+            printf("dpsetzerocopy: no SO_ZEROCOPY (%s)\n", strerror(errno));
+        dp->zeroCopy = false;
+        return on ? DP_ERROR_GENERAL : DP_NO_ERROR;
+    }
+    dp->zeroCopy = on;
+    dp->zcCopied = 0;
+    return DP_NO_ERROR;
+#else
+    dp->zeroCopy = false;
+    return on ? DP_ERROR_GENERAL : DP_NO_ERROR;
+#endif
+}
+
+/*
+ * Turns segmentation offload on or off, see the notes in du-proto.h.
+ * DP_ERROR_GENERAL if it was built without UDP_SEGMENT or the connection
+   is on a local socket.
+*/
+int dpsetgso(dp_connp dp, int on){
+#ifdef UDP_SEGMENT
+    dp->gso = (on && !dp->reliable) ? true : false;
+    return (on && dp->reliable) ? DP_ERROR_GENERAL : DP_NO_ERROR;
+#else
+    dp->gso = false;
+    return on ? DP_ERROR_GENERAL : DP_NO_ERROR;
+#endif
+}
+
+/*
+ * Turns receive offload on or off, see the notes in du-proto.h.
+ * DP_ERROR_GENERAL if the kernel has no UDP_GRO.
+*/
+int dpsetgro(dp_connp dp, int on){
+#ifdef UDP_GRO
+    on = on ? 1 : 0;
+    // Room for a whole run plus the part of the first datagram that
+    // did not fit the caller's buffer
+    if (on && dp->groBuf == NULL) {
+        dp->groBuf = malloc(DP_MAX_DGRAM_SZ + DP_GRO_BUF_SZ);
+        if (dp->groBuf == NULL)
+            return DP_ERROR_GENERAL;
+    }
+    if (setsockopt(dp->udp_sock, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) != 0) {
+        if (on)
+            printf("dpsetgro: no UDP_GRO (%s)\n", strerror(errno));
+        dp->gro = false;
+        return on ? DP_ERROR_GENERAL : DP_NO_ERROR;
+    }
+    dp->gro = on;
+    return DP_NO_ERROR;
+#else
+    dp->gro = false;
+    return on ? DP_ERROR_GENERAL : DP_NO_ERROR;
+#endif
+}
+
+/*
+ * Lets the connection offer (client) or take (server) a same host link,
+   on by default, see the notes in du-proto.h.  Only the handshake looks
+   at it, a link that is up stays up.
+*/
+int dpsetshm(dp_connp dp, int on){
+    dp->shmOff = !on;
+    return DP_NO_ERROR;
+}
+
+/*
+ * Sets the ceiling the socket buffers may be grown to as the
+   bandwidth-delay product is measured, 0 turns the tuning off and leaves
+   the buffers at whatever size they have reached.
+*/
+int dpsetsockbuf(dp_connp dp, int max_bytes){
+    if (max_bytes < 0)
+        return DP_ERROR_GENERAL;
+    dp->sockBufMax = max_bytes;
+    return DP_NO_ERROR;
+}
+
+/*
+ * Datagrams the kernel dropped on this connection's socket because its
+   receive buffer was full, as last reported along with a datagram
+*/
+long dprxdrops(dp_connp dp){
+    return dp->rxDrops;
+}
+
+/*
+ * Makes dplisten() insist on a handshake cookie before it keeps any
+   state for a client, see the notes in du-proto.h.
+ * A new random key is drawn every time cookies are turned on.
+*/
+int dpsetcookies(dp_connp dp, int on){
+    FILE *f;
+
+    dp->useCookies = on;
+    if (!on)
+        return DP_NO_ERROR;
+
+    f = fopen("/dev/urandom", "rb");
+    if (f == NULL || fread(dp->cookieKey, sizeof(dp->cookieKey), 1, f) != 1) {
+        // not much of a secret, but the cookies still prove reachability
+        dp->cookieKey[0] = (uint64_t)time(0) ^ ((uint64_t)getpid() << 32);
+        dp->cookieKey[1] = (uint64_t)(uintptr_t)dp ^ dpnow();
+    }
+    if (f != NULL)
+        fclose(f);
+    return DP_NO_ERROR;
+}
+
 /*
  * Will initialize the server protocol connection.
  * A protocol connection will be initalized with default values.
@@ -125,6 +425,12 @@ dp_connp dpServerInit(int port) {
         close (*sock);
         return NULL;
     } 
+    dpinitwnd(dpc);
+
+    // Clients on this host offer their links here
+    char shmName[32];
+    snprintf(shmName, sizeof(shmName), DP_SHM_NAME, port);
+    dpc->shmSock = dmlisten(shmName);
 
     dpc->inSockAddr.isAddrInit = true;
     dpc->outSockAddr.len = sizeof(struct sockaddr_in);
@@ -170,6 +476,122 @@ dp_connp dpClientInit(char *addr, int port) {
 
     // The inbound address is the same as the outbound address
     memcpy(&dpc->inSockAddr, &dpc->outSockAddr, sizeof(dpc->outSockAddr));
+    dpinitwnd(dpc);
+
+    return dpc;
+}
+
+/*
+ * Creates the AF_UNIX datagram socket of a new local socket connection
+   and switches it to large fragments, see the notes in du-proto.h.
+ * addr gets path filled in, returns false if it is too long or the
+   socket or the larger pool cannot be had.
+*/
+static bool dpunixinit(dp_connp dpc, struct dp_sock *addr, const char *path){
+    if (strlen(path) == 0 || strlen(path) >= sizeof(addr->unAddr.sun_path)) {
+        printf("dpunixinit: bad socket path \"%s\"\n", path);
+        return false;
+    }
+    addr->unAddr.sun_family = AF_UNIX;
+    strcpy(addr->unAddr.sun_path, path);
+    addr->len = sizeof(struct sockaddr_un);
+
+    if ((dpc->udp_sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+        perror("socket creation failed");
+        return false;
+    }
+
+    dpc->reliable = true;
+    dpc->gso = false;
+    if (dpsetfrag(dpc, DP_UNIX_BUFF_SZ) != DP_NO_ERROR) {
+        close(dpc->udp_sock);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * A socket at addr is stale if nobody is bound to it any more, which a
+   connect() to it reports as ECONNREFUSED
+*/
+static bool dpunixstale(struct dp_sock *addr){
+    int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    bool stale;
+
+    if (sock < 0)
+        return false;
+    stale = connect(sock, (const struct sockaddr *)&addr->unAddr, addr->len) < 0 &&
+        errno == ECONNREFUSED;
+    close(sock);
+    return stale;
+}
+
+/*
+ * Same as dpServerInit(), but the server takes its clients on an
+   AF_UNIX datagram socket bound to path instead of a UDP port
+*/
+dp_connp dpServerInitUnix(const char *path) {
+    dp_connp dpc = dpinit();
+    if (dpc == NULL) {
+        perror("drexel protocol create failure");
+        return NULL;
+    }
+    if (!dpunixinit(dpc, &dpc->inSockAddr, path)) {
+        dpclose(dpc);
+        return NULL;
+    }
+
+    // A socket file left over from an earlier server is in the way,
+    // anything else at path, or a server still running there, is not
+    // this side's to remove
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode) && dpunixstale(&dpc->inSockAddr))
+        unlink(path);
+    if (bind(dpc->udp_sock, (const struct sockaddr *)&dpc->inSockAddr.unAddr,
+            dpc->inSockAddr.len) < 0) {
+        perror("bind failed");
+        close(dpc->udp_sock);
+        dpclose(dpc);
+        return NULL;
+    }
+    dpc->ownsPath = true;
+    dpinitwnd(dpc);
+
+    dpc->inSockAddr.isAddrInit = true;
+    dpc->outSockAddr.len = sizeof(struct sockaddr_un);
+    return dpc;
+}
+
+/*
+ * Same as dpClientInit(), but the server is the one dpServerInitUnix()
+   bound to path
+*/
+dp_connp dpClientInitUnix(const char *path) {
+    sa_family_t family = AF_UNIX;
+
+    dp_connp dpc = dpinit();
+    if (dpc == NULL) {
+        perror("drexel protocol create failure");
+        return NULL;
+    }
+    if (!dpunixinit(dpc, &dpc->outSockAddr, path)) {
+        dpclose(dpc);
+        return NULL;
+    }
+
+    // Binding nothing but the family has the kernel pick an abstract
+    // address, the server needs one to answer to
+    if (bind(dpc->udp_sock, (const struct sockaddr *)&family, sizeof(family)) < 0) {
+        perror("bind failed");
+        close(dpc->udp_sock);
+        dpclose(dpc);
+        return NULL;
+    }
+    dpc->outSockAddr.isAddrInit = true;
+
+    // The inbound address is the same as the outbound address
+    memcpy(&dpc->inSockAddr, &dpc->outSockAddr, sizeof(dpc->outSockAddr));
+    dpinitwnd(dpc);
 
     return dpc;
 }
@@ -179,43 +601,208 @@ dp_connp dpClientInit(char *addr, int port) {
  * Will loop until the entire file is recieved.
  * The loop will be broken when either a connection closed
    is recieved or fragments are done being sent.
- * In the loop, dpsenddgram() will be called which will
+ * In the loop, dprecvdgram() will be called which will
    recieve file data and build an ACK PDU.
  * Next, if a connection close was recieved, the method
    will return said close connection number.
  * Then, if not a connection close, the file data will be
-   extracted from the recieve buffer.
+   extracted from the recieve buffer.  Datagrams that belong
+   to an FEC group are handed to dprecvfec() instead, which
+   only returns data once the whole group is in (or rebuilt).
  * After the loop is finished, return the total bytes recieved.
 */
-int dprecv(dp_connp dp, void *buff, int buff_sz){
+ssize_t dprecv(dp_connp dp, void *buff, size_t buff_sz){
+    struct iovec iov = { .iov_base = buff, .iov_len = buff_sz };
+    return dprecvv(dp, &iov, 1);
+}
+
+/*
+ * Same as dprecv(), but the message is placed across the buffers of iov
+   in order, filling one before moving on to the next.  The payloads are
+   copied there from _dpBuffer.
+*/
+ssize_t dprecvv(dp_connp dp, const struct iovec *iov, int iovcnt){
 
     dp_pdu *inPdu;
-    void *rptr = buff;
-    int totalRecieved = 0;
+    size_t buff_sz = dpiovlen(iov, iovcnt);
+    ssize_t totalRecieved = 0;
     int amount_recieved = 0;
     bool isFragment = false;
+    uint64_t rxStart = 0;
+
+    // The peer closed along with its last message
+    if (dp->peerClosed) {
+        dpclose(dp);
+        return DP_CONNECTION_CLOSED;
+    }
+
+    // Data that came with the CONNECT is the first message
+    if (dp->earlySz > 0) {
+        if ((size_t)dp->earlySz > buff_sz)
+            return DP_BUFF_UNDERSIZED;
+        dpiovwrite(iov, iovcnt, 0, dp->early, dp->earlySz);
+        totalRecieved = dp->earlySz;
+        dp->earlySz = 0;
+        return totalRecieved;
+    }
+
+    // The sender starts counting its window again with every send
+    dp->lastAckSeq = dp->seqNum;
 
     // Loop to read the entire file
     do {
 
-        amount_recieved = dprecvdgram(dp, _dpBuffer, sizeof(_dpBuffer));
+        dp->rxSpace = buff_sz - totalRecieved;
+        amount_recieved = dprecvdgram(dp, _dpBuffer, dp->fragSz + sizeof(dp_pdu));
+        dp->rxSpace = -1;
         if(amount_recieved == DP_CONNECTION_CLOSED)
             return DP_CONNECTION_CLOSED;
+        if(amount_recieved == DP_ERROR_SEQUENCE) {
+            isFragment = true;      // dropped, keep waiting for the right one
+            continue;
+        }
+        if(amount_recieved < 0)
+            return amount_recieved;
+        if(rxStart == 0)
+            rxStart = dpnow();
 
         inPdu = (dp_pdu *)_dpBuffer;
+        if(IS_FEC_PDU(inPdu)) {
+            isFragment = true;
+            amount_recieved = dprecvfec(dp, iov, iovcnt, totalRecieved, buff_sz - totalRecieved, &isFragment);
+            if(amount_recieved < 0)
+                return amount_recieved;
+            totalRecieved += amount_recieved;
+            continue;
+        }
+
+        if((size_t)totalRecieved + inPdu->dgram_sz > buff_sz)
+            return DP_BUFF_UNDERSIZED;
         if(amount_recieved > sizeof(dp_pdu))
-            memcpy(rptr, (_dpBuffer+sizeof(dp_pdu)), inPdu->dgram_sz); // ignores the PDU
+            dpiovwrite(iov, iovcnt, totalRecieved, _dpBuffer + sizeof(dp_pdu), inPdu->dgram_sz); // ignores the PDU
         
-        rptr += (amount_recieved - sizeof(dp_pdu)); // don't want to increment an additional 20 bytes for the pdu
         totalRecieved += (amount_recieved - sizeof(dp_pdu)); // don't want to increment an additional 20 bytes for the pdu
         isFragment = IS_MT_FRAGMENT(inPdu->mtype);
 
     } while(isFragment);
 
+    dp->rxEndSeq = dp->seqNum;
+
+    // Rate the message came in at, for sizing the receive buffer
+    uint64_t now = dpnow();
+    if (totalRecieved >= 2 * DP_MAX_BUFF_SZ && now > rxStart) {
+        double sample = totalRecieved * 1e9 / (now - rxStart);
+        dp->rxRateEst = (dp->rxRateEst <= 0) ? sample : (7 * dp->rxRateEst + sample) / 8;
+        dptunebufs(dp, SO_RCVBUF, dp->rxRateEst);
+    }
     return totalRecieved;
     
 }
 
+/*
+ * Handles one datagram of an FEC group, the datagram is in _dpBuffer.
+ * Data datagrams are copied into the caller's buffers at their
+   offset in the group (the group starts off bytes into iov) and parity
+   datagrams are kept aside.  Datagrams of
+   a group that is already complete (e.g. parity that was not needed) are
+   ignored.
+ * Once every data datagram is either in or can be rebuilt from a parity
+   datagram, the group is ACKed as a whole and its size is returned,
+   more is set if the message continues after this group.
+ * Returns 0 while the group is still incomplete.
+*/
+static int dprecvfec(dp_connp dp, const struct iovec *iov, int iovcnt, size_t off, size_t buff_sz, bool *more){
+    struct dp_fec_group *fg = &dp->fecRx;
+    dp_pdu *inPdu = (dp_pdu *)_dpBuffer;
+    char *payload = _dpBuffer + sizeof(dp_pdu);
+    char rebuilt[DP_MAX_BUFF_SZ];
+    char other[DP_MAX_BUFF_SZ];
+    int i, j, total = 0;
+
+    //Only the group that starts at the next expected seqnum is of interest
+    if (inPdu->fec_base != dp->seqNum || inPdu->fec_n > DP_FEC_MAX_N || 
+            inPdu->fec_k == 0 || inPdu->fec_k > DP_FEC_MAX_K)
+        return 0;
+
+    if (!fg->active || fg->base != inPdu->fec_base) {
+        fg->active = true;
+        fg->base = inPdu->fec_base;
+        fg->n = inPdu->fec_n;
+        fg->k = inPdu->fec_k;
+        fg->haveData = 0;
+        fg->haveParity = 0;
+    }
+
+    i = inPdu->fec_idx;
+    if (inPdu->dgram_sz > DP_MAX_BUFF_SZ)
+        return DP_ERROR_BAD_DGRAM;
+    if (inPdu->mtype & DP_MT_PARITY) {
+        j = i - fg->n;
+        if (j < 0 || j >= fg->k)
+            return DP_ERROR_BAD_DGRAM;
+        memcpy(fg->parity[j], payload, DP_MAX_BUFF_SZ);
+        fg->parityLen[j] = inPdu->fec_len;
+        fg->parityMtype[j] = inPdu->fec_mtype;
+        fg->haveParity |= 1u << j;
+    } else {
+        if (i >= fg->n)
+            return DP_ERROR_BAD_DGRAM;
+        if ((size_t)i * DP_MAX_BUFF_SZ + inPdu->dgram_sz > buff_sz)
+            return DP_BUFF_UNDERSIZED;
+        dpiovwrite(iov, iovcnt, off + (size_t)i * DP_MAX_BUFF_SZ, payload, inPdu->dgram_sz);
+        fg->len[i] = inPdu->dgram_sz;
+        fg->mtype[i] = inPdu->mtype;
+        fg->haveData |= 1u << i;
+    }
+
+    //Rebuild any missing datagram whose parity class is otherwise complete
+    for (i = 0; i < fg->n; i++) {
+        if (fg->haveData & (1u << i))
+            continue;
+        j = i % fg->k;
+        if (!(fg->haveParity & (1u << j)))
+            continue;
+
+        int missing = 0;
+        int len = fg->parityLen[j];
+        int mtype = fg->parityMtype[j];
+        memcpy(rebuilt, fg->parity[j], DP_MAX_BUFF_SZ);
+        for (int m = j; m < fg->n; m += fg->k) {
+            if (m == i)
+                continue;
+            if (!(fg->haveData & (1u << m))) {
+                missing++;
+                break;
+            }
+            dpiovread(iov, iovcnt, off + (size_t)m * DP_MAX_BUFF_SZ, other, fg->len[m]);
+            dpxor(rebuilt, other, fg->len[m]);
+            len ^= fg->len[m];
+            mtype ^= fg->mtype[m];
+        }
+        if (missing || len < 0 || len > DP_MAX_BUFF_SZ || (size_t)i * DP_MAX_BUFF_SZ + len > buff_sz)
+            continue;
+
+        dpiovwrite(iov, iovcnt, off + (size_t)i * DP_MAX_BUFF_SZ, rebuilt, len);
+        fg->len[i] = len;
+        fg->mtype[i] = mtype;
+        fg->haveData |= 1u << i;
+    }
+
+    if (fg->haveData != (fg->n == 32 ? 0xffffffffu : (1u << fg->n) - 1))
+        return 0;
+
+    //Whole group is in, ACK it in one go
+    for (i = 0; i < fg->n; i++)
+        total += fg->len[i];
+    fg->active = false;
+    dp->seqNum += total;
+    *more = IS_MT_FRAGMENT(fg->mtype[fg->n - 1]);
+    if (dpsendack(dp, *more ? DP_MT_SNDFRAGACK : DP_MT_SNDACK, DP_NO_ERROR) != sizeof(dp_pdu))
+        return DP_ERROR_PROTOCOL;
+
+    return total;
+}
+
 /*
  * Recieve raw data and build an ACK PDU based on the recieved data.
  * First, raw data will be recieved from the socket.
@@ -236,10 +823,12 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
     int errCode = DP_NO_ERROR;
     bool isFragment = false;
 
-    if(buff_sz > DP_MAX_DGRAM_SZ)
+    if(buff_sz > dp->fragSz + (int)sizeof(dp_pdu))
         return DP_BUFF_OVERSIZED;
 
     bytesIn = dprecvraw(dp, buff, buff_sz);
+    if (bytesIn == DP_ERROR_TIMEOUT)
+        return bytesIn;
 
     //check for some sort of error and just return it
     if (bytesIn < sizeof(dp_pdu))
@@ -252,6 +841,41 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
     
     // Determine if the in mtype is a fragment
     isFragment = IS_MT_FRAGMENT(inPdu.mtype);
+
+    // Keepalives and late duplicates of answers need no answer
+    if (errCode == DP_NO_ERROR && (inPdu.mtype & (DP_MT_ACK | DP_MT_NACK)))
+        return DP_ERROR_SEQUENCE;
+
+    // FEC groups are sequenced and ACKed as a whole by dprecvfec()
+    if (errCode == DP_NO_ERROR && IS_FEC_PDU(&inPdu))
+        return bytesIn;
+
+    // A CONNECT showing up again is a duplicate of the one dplisten()
+    // answered, its data was delivered already.  It only gets a new
+    // CNTACK if nothing else came in since, i.e. the first one was lost.
+    if (errCode == DP_NO_ERROR && inPdu.mtype == DP_MT_CONNECT) {
+        if (inPdu.seqnum != dp->connSeq)
+            return DP_ERROR_PROTOCOL;
+        if (dp->seqNum == dp->connAckSeq) {
+            inPdu.mtype = DP_MT_CNTACK;
+            inPdu.seqnum = dp->connAckSeq;
+            inPdu.dgram_sz = 0;
+            inPdu.rwnd = dp->lastWnd;
+            if (dpsendraw(dp, &inPdu, sizeof(dp_pdu)) != sizeof(dp_pdu))
+                return DP_ERROR_PROTOCOL;
+        }
+        return DP_ERROR_SEQUENCE;
+    }
+
+    // Data that is not next in sequence is dropped, an immediate
+    // cumulative ACK tells the sender where this side really is
+    if (errCode == DP_NO_ERROR && (inPdu.mtype & ~(DP_MT_FRAGMENT | DP_MT_CLOSE)) == DP_MT_SND &&
+            inPdu.seqnum != dp->seqNum) {
+        dp->rxUnacked = 0;
+        if (dpsendack(dp, DP_MT_SNDFRAGACK, DP_NO_ERROR) != sizeof(dp_pdu))
+            return DP_ERROR_PROTOCOL;
+        return DP_ERROR_SEQUENCE;
+    }
     
     //UDPATE SEQ NUMBER AND PREPARE ACK
     if (errCode == DP_NO_ERROR){
@@ -266,17 +890,10 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
         dp->seqNum++;
     }
 
-    dp_pdu outPdu;
-    outPdu.proto_ver = DP_PROTO_VER_1;
-    outPdu.dgram_sz = 0;
-    outPdu.seqnum = dp->seqNum;
-    outPdu.err_num = errCode;
-
     int actSndSz = 0;
     //HANDLE ERROR SITUATION
     if(errCode != DP_NO_ERROR) {
-        outPdu.mtype = DP_MT_ERROR;
-        actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
+        actSndSz = dpsendack(dp, DP_MT_ERROR, errCode);
         if (actSndSz != sizeof(dp_pdu))
             return DP_ERROR_PROTOCOL;
     }
@@ -287,21 +904,30 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
         case DP_MT_SND: // need to send back a send ACK
         case DP_MT_SNDFRAG:
 
+            // Fragments are ACKed cumulatively every ackEvery datagrams
+            // (or when the delay runs out), the last datagram right away,
+            // and as soon as the sender has used up the advertised window
+            if (isFragment && errCode == DP_NO_ERROR && ++dp->rxUnacked < dp->ackEvery &&
+                    (int64_t)(dp->seqNum - dp->lastAckSeq) + dp->fragSz <= dp->lastWnd) {
+                if (!dtpending(&dp->ackTimer))
+                    dptimerstart(&dp->ackTimer, DP_ACK_DELAY_MS);
+                break;
+            }
+
             // If the in mtype is a fragment, then the out mtype is a fragment
             // else, the out mtype is a regular send
-            if(isFragment) {
-                outPdu.mtype = DP_MT_SNDFRAGACK;
-            } else {
-                outPdu.mtype = DP_MT_SNDACK;
-            }
-            
-            actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
+            actSndSz = dpsendack(dp, isFragment ? DP_MT_SNDFRAGACK : DP_MT_SNDACK, errCode);
+            if (actSndSz != sizeof(dp_pdu))
+                return DP_ERROR_PROTOCOL;
+            break;
+        case DP_MT_SNDCLOSE: // last datagram, the connection closes after it
+            actSndSz = dpsendack(dp, DP_MT_SNDCLOSEACK, errCode);
             if (actSndSz != sizeof(dp_pdu))
                 return DP_ERROR_PROTOCOL;
+            dp->peerClosed = true;
             break;
         case DP_MT_CLOSE: // need to send back a close ACK
-            outPdu.mtype = DP_MT_CLOSEACK;
-            actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
+            actSndSz = dpsendack(dp, DP_MT_CLOSEACK, errCode);
             if (actSndSz != sizeof(dp_pdu))
                 return DP_ERROR_PROTOCOL;
             dpclose(dp);
@@ -316,6 +942,216 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
     return bytesIn;
 }
 
+/*
+ * Builds an ACK (or error) PDU for the current sequence
+   number and sends it back to the peer
+*/
+static int dpsendack(dp_connp dp, int mtype, int errCode){
+    dp_pdu outPdu = {0};
+    outPdu.proto_ver = DP_PROTO_VER_1;
+    outPdu.mtype = mtype;
+    outPdu.dgram_sz = 0;
+    outPdu.seqnum = dp->seqNum;
+    outPdu.err_num = errCode;
+    outPdu.rwnd = dpwindow(dp, mtype);
+    dp->rxUnacked = 0;
+    dptimerstop(&dp->ackTimer);
+    dp->lastAckSeq = dp->seqNum;
+    dp->lastWnd = outPdu.rwnd;
+    return dpsendraw(dp, &outPdu, sizeof(dp_pdu));
+}
+
+/*
+ * Waits for the cumulative SND ACK that covers everything
+   sent so far.  Older cumulative ACKs (sent by a receiver that ACKs
+   more often than this side waits, or by its delay timer) are skipped.
+ * The retransmit timer runs while waiting, every ACK that makes
+   progress restarts it and DP_DUPACK_THRESH duplicates of the same
+   ACK retransmit right away.  Only waits without any retransmit give
+   a round trip time sample.
+*/
+static int dpwaitack(dp_connp dp){
+    dp_pdu inPdu = {0};
+    int bytesIn;
+    int dupAcks = 0;
+
+    dp->rttStart = dpnow();
+    dp->rtxCount = 0;
+    dptimerstart(&dp->rtxTimer, dp->rto);
+
+    do {
+        bytesIn = dprecvack(dp, &inPdu);
+        if (bytesIn < 0) {
+            dptimerstop(&dp->rtxTimer);
+            return bytesIn;
+        }
+        if (bytesIn < (int)sizeof(dp_pdu) || (inPdu.mtype & DP_MT_SNDACK) != DP_MT_SNDACK) {
+            printf("Expected SND/ACK but got a different mtype %d\n", inPdu.mtype);
+            dptimerstop(&dp->rtxTimer);
+            return DP_ERROR_PROTOCOL;
+        }
+        if (inPdu.seqnum > dp->peerAckSeq && inPdu.seqnum < dp->seqNum) {
+            dp->peerAckSeq = inPdu.seqnum;
+            dupAcks = 0;
+            dptimerstart(&dp->rtxTimer, dp->rto);
+        } else if (inPdu.seqnum == dp->peerAckSeq && ++dupAcks == DP_DUPACK_THRESH) {
+            dp->rtxCount++;
+            dpretransmit(dp);
+        }
+    } while (inPdu.seqnum < dp->seqNum);
+    dptimerstop(&dp->rtxTimer);
+
+    if (inPdu.seqnum != dp->seqNum) {
+        printf("SND/ACK for %" PRIu64 " is ahead of what was sent %" PRIu64 "\n",
+                inPdu.seqnum, dp->seqNum);
+        return DP_ERROR_PROTOCOL;
+    }
+    if (dp->rtxCount == 0)
+        dprttsample(dp, dpnow() - dp->rttStart);
+    dpratesample(dp);
+    dptunebufs(dp, SO_SNDBUF, dp->rateEst);
+    if (inPdu.rwnd > 0)
+        dp->peerWnd = inPdu.rwnd;
+    dp->peerAckSeq = inPdu.seqnum;
+    return bytesIn;
+}
+
+/*
+ * Waits for the peer's answer to something this side sent.
+ * Parity datagrams that show up here belong to an FEC group the peer
+   sent earlier which was already complete without them, so they are
+   skipped, as are keepalives and duplicate CONNECTs.
+ * Data from the peer means one of two things.  If it is older than
+   what this side has sent, the peer missed the ACK for its last
+   message and gets it again.  Otherwise the peer already has all of
+   this side's message and moved on, which counts as the ACK, and the
+   datagram is put back for the next dprecv().
+*/
+static int dprecvack(dp_connp dp, dp_pdu *pdu){
+    int bytesIn;
+    char *buf;
+
+    while (1) {
+        buf = dbget(&dp->pool);
+        if (buf == NULL) {
+            printf("dprecvack: datagram pool is empty\n");
+            return DP_ERROR_GENERAL;
+        }
+        bytesIn = dprecvraw(dp, buf, dp->fragSz + sizeof(dp_pdu));
+        if (bytesIn < (int)sizeof(dp_pdu)) {
+            dbput(buf);
+            return bytesIn;
+        }
+        memcpy(pdu, buf, sizeof(dp_pdu));
+
+        if ((pdu->mtype & DP_MT_PARITY) || pdu->mtype == DP_MT_ACK ||
+                pdu->mtype == DP_MT_CONNECT) {
+            dbput(buf);
+            continue;
+        }
+        if (!(pdu->mtype & DP_MT_SND) || (pdu->mtype & DP_MT_ACK)) {
+            dbput(buf);
+            return bytesIn;
+        }
+
+        if (pdu->seqnum < dp->seqNum) {
+            dp_pdu ack = {0};
+            ack.proto_ver = DP_PROTO_VER_1;
+            ack.mtype = DP_MT_SNDACK;
+            ack.seqnum = dp->rxEndSeq;
+            ack.rwnd = dp->lastWnd;
+            dpsendraw(dp, &ack, sizeof(ack));
+            dbput(buf);
+            continue;
+        }
+
+        // The buffer itself is put back, no copy
+        dp->stash = buf;
+        dp->stashSz = bytesIn;
+        bzero(pdu, sizeof(dp_pdu));
+        pdu->proto_ver = DP_PROTO_VER_1;
+        pdu->mtype = DP_MT_SNDACK;
+        pdu->seqnum = dp->seqNum;
+        return sizeof(dp_pdu);
+    }
+}
+
+/*
+ * Waits for the answer to a CONNECT or CLOSE (ctl) that was just sent,
+   sending it again whenever the retransmit timer runs out.
+ * ctl is a pool buffer, the retransmit slot holds its own reference
+   to it while the answer is outstanding.
+*/
+static int dpwaitctl(dp_connp dp, void *ctl, int ctl_sz, dp_pdu *pdu){
+    int bytesIn;
+
+    dbhold(ctl);
+    dp->rtxCtl = ctl;
+    dp->rtxCtlSz = ctl_sz;
+    dp->rtxCount = 0;
+    dp->rttStart = dpnow();
+    dptimerstart(&dp->rtxTimer, dp->rto);
+
+    bytesIn = dprecvack(dp, pdu);
+
+    dptimerstop(&dp->rtxTimer);
+    // The handshake gives the first RTT sample, the buffers are tuned with it
+    if (bytesIn == sizeof(dp_pdu) && dp->rtxCount == 0)
+        dprttsample(dp, dpnow() - dp->rttStart);
+    dbput(dp->rtxCtl);
+    dp->rtxCtl = NULL;
+    dp->rtxCtlSz = 0;
+    return bytesIn;
+}
+
+/*
+ * Sends everything from the peer's last cumulative ACK up to seqNum
+   again (go-back-N), or the CONNECT or CLOSE that is waiting for its
+   answer.
+ * Data always goes out as plain datagrams, even when it was first sent
+   in FEC groups, the receiver takes those at any point of a group.
+*/
+static void dpretransmit(dp_connp dp){
+    static char rtxBuffer[DP_UNIX_BUFF_SZ];
+    struct iovec dgIov[1 + DP_MAX_DGRAM_IOV];
+    dp_pdu pdu;
+    dp_pdu *outPdu = &pdu;
+    uint64_t seq = dp->peerAckSeq;
+
+    if (dp->rtxCtlSz > 0) {
+        dpsendraw(dp, dp->rtxCtl, dp->rtxCtlSz);
+        return;
+    }
+    // A local socket lost nothing, the peer is only slow
+    if (dp->txIov == NULL || (dp->reliable && dp->dropPct == 0))
+        return;
+
+    while (seq < dp->seqNum) {
+        size_t off, sz;
+        if (seq < dp->txBase || seq - dp->txBase >= dp->txLen)
+            break;
+        off = seq - dp->txBase;
+        sz = dp->txLen - off;
+        if (sz > (size_t)dp->fragSz)
+            sz = dp->fragSz;
+
+        bzero(outPdu, sizeof(dp_pdu));
+        outPdu->proto_ver = DP_PROTO_VER_1;
+        outPdu->seqnum = seq;
+        outPdu->dgram_sz = sz;
+        if (off + sz < dp->txLen)
+            outPdu->mtype = DP_MT_SNDFRAG;
+        else
+            outPdu->mtype = dp->closeOnLast ? DP_MT_SNDCLOSE : DP_MT_SND;
+        dgIov[0].iov_base = outPdu;
+        dgIov[0].iov_len = sizeof(dp_pdu);
+        int n = dpgather(dp->txIov, dp->txIovCnt, off, sz, dgIov + 1, rtxBuffer);
+
+        dpsendrawv(dp, dgIov, n + 1, dpzcflags(dp, dgIov + 1, rtxBuffer));
+        seq += sz;
+    }
+}
+
 /*
  * Recieve raw data from a socket.
  * Will connect to the udp socket and write the data to the buffer.
@@ -332,15 +1168,76 @@ static int dprecvraw(dp_connp dp, void *buff, int buff_sz){
         return -1;
     }
 
-    bytes = recvfrom(dp->udp_sock, (char *)buff, buff_sz,  
-                MSG_WAITALL, ( struct sockaddr *) &(dp->outSockAddr.addr), 
-                &(dp->outSockAddr.len)); 
+    // A datagram dprecvack() put back comes first
+    if (dp->stash != NULL) {
+        bytes = (dp->stashSz < buff_sz) ? dp->stashSz : buff_sz;
+        memcpy(buff, dp->stash, bytes);
+        dbput(dp->stash);
+        dp->stash = NULL;
+        dp->stashSz = 0;
+        print_in_pdu((dp_pdu *)buff);
+        return bytes;
+    }
 
-    if (bytes < 0) {
-        perror("dprecv: received error from recvfrom()");
-        return -1;
+    // Then the rest of a run the kernel coalesced
+    if (dp->groOff < dp->groLen) {
+        bytes = dpgronext(dp, buff, buff_sz);
+        print_in_pdu((dp_pdu *)buff);
+        return bytes;
     }
-    dp->outSockAddr.isAddrInit = true;
+
+    // Busy poll: try the socket without sleeping for up to busyPollUs,
+    // the timers still run in between
+    bytes = -1;
+    if (dp->busyPollUs > 0) {
+        uint64_t spinEnd = dpnow() + (uint64_t)dp->busyPollUs * 1000;
+        do {
+            if (dp->timedOut)
+                return DP_ERROR_TIMEOUT;
+            bytes = dprecvmsg(dp, buff, buff_sz, MSG_DONTWAIT);
+            if (bytes >= 0)
+                break;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("dprecv: received error from recvmsg()");
+                return -1;
+            }
+            dtadvance(dpwheel(), dpms());
+        } while (dpnow() < spinEnd);
+    }
+
+    // Keep the timers of every connection going until something arrives
+    while (bytes < 0) {
+        struct pollfd pfd[2] = {
+            { .fd = dp->udp_sock, .events = POLLIN },
+            { .fd = (dp->shm != NULL) ? dmfd(dp->shm) : -1, .events = POLLIN },
+        };
+        int rc;
+
+        if (dp->timedOut)
+            return DP_ERROR_TIMEOUT;
+        rc = poll(pfd, 2, dtnext(dpwheel()));
+        dtadvance(dpwheel(), dpms());
+        // Zero copy completions wake poll() up with POLLERR only
+        if (rc > 0 && (pfd[0].revents & POLLERR))
+            dpzcreap(dp, 0);
+        if (rc > 0 && !(pfd[0].revents & POLLIN) && !(pfd[1].revents & POLLIN))
+            continue;
+        if (rc > 0) {
+            bytes = dprecvmsg(dp, buff, buff_sz, MSG_WAITALL);
+            // The wakeup of a link can be for a datagram already taken
+            if (bytes < 0 && dp->shm != NULL && errno == EAGAIN)
+                continue;
+            if (bytes < 0) {
+                perror("dprecv: received error from recvmsg()");
+                return -1;
+            }
+        } else if (rc < 0 && errno != EINTR) {
+            perror("dprecv: received error from poll()");
+            return -1;
+        }
+    }
+    if (dp->isConnected && dp->idleMs > 0)
+        dptimerstart(&dp->idleTimer, dp->idleMs);
 
     //some helper code if you want to do debugging
     if (bytes > sizeof(dp_pdu)){
@@ -359,41 +1256,170 @@ static int dprecvraw(dp_connp dp, void *buff, int buff_sz){
 }
 
 /*
- * Initiate the send process.
- * Since the entire file is now in the buffer,
-   the buffer will be looped 512 bytes at a time.
- * A pointer to the file buffer will increment 512
-   bytes at a time until there is less than that left.
- * dpsenddgram() will recieve that file pointer and
-   enforce the 512 byte cap for the datagram.
- * After that, a check will be done to make sure that
-   the amount sent matches the size of the file.
+ * One recvmsg() on the socket with the given flags, the sender becomes
+   the address replies go to.
+ * recvmsg() rather than recvfrom() so the kernel's drop count comes
+   along (SO_RXQ_OVFL).
+*/
+static int dprecvmsg(dp_connp dp, void *buff, int buff_sz, int flags){
+    struct iovec iov[2] = {{ .iov_base = buff, .iov_len = buff_sz }};
+    char ctrl[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {0};
+    int bytes, seg = 0;
+
+    // The same host link first, the socket is still read for strays
+    if (dp->shm != NULL) {
+        bytes = dmrecv(dp->shm, buff, buff_sz);
+        if (bytes >= 0)
+            return bytes;
+        flags = MSG_DONTWAIT;
+    }
+
+    msg.msg_name = &(dp->outSockAddr.addr);
+    msg.msg_namelen = sizeof(dp->outSockAddr.unAddr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+
+    // A run the kernel coalesced goes on past the caller's buffer
+    if (dp->gro) {
+        if (iov[0].iov_len > DP_MAX_DGRAM_SZ)
+            iov[0].iov_len = DP_MAX_DGRAM_SZ;
+        iov[1].iov_base = dp->groBuf + DP_MAX_DGRAM_SZ;
+        iov[1].iov_len = DP_GRO_BUF_SZ;
+        msg.msg_iovlen = 2;
+    }
+
+    bytes = recvmsg(dp->udp_sock, &msg, flags);
+    if (bytes < 0)
+        return bytes;
+    dp->outSockAddr.len = msg.msg_namelen;
+    dp->outSockAddr.isAddrInit = true;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+#ifdef SO_RXQ_OVFL
+        uint32_t drops;
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+            if (drops != dp->rxDrops) {
+                // The buffer overflowed, it is too small whatever the estimate says
+                dp->rxDrops = drops;
+                dpsockbuf(dp, SO_RCVBUF, dp->rcvBuf);
+            }
+        }
+#endif
+#ifdef UDP_GRO
+        if (c->cmsg_level == IPPROTO_UDP && c->cmsg_type == UDP_GRO)
+            memcpy(&seg, CMSG_DATA(c), sizeof(seg));
+#endif
+    }
+    if (!dp->gro)
+        return bytes;
+
+    /*
+     * The datagrams of the run are back to back across both buffers, the
+       first one is the caller's.  What follows it in the caller's buffer
+       is moved in front of the rest so they are in one piece.
+    */
+    int first = iov[0].iov_len;
+    if (seg <= 0 || seg > bytes)
+        seg = bytes;
+    dp->groSeg = seg;
+    dp->groLen = DP_MAX_DGRAM_SZ + ((bytes > first) ? bytes - first : 0);
+    if (seg < first) {
+        int extra = ((bytes < first) ? bytes : first) - seg;
+        memcpy(dp->groBuf + DP_MAX_DGRAM_SZ - extra, (char *)buff + seg, extra);
+        dp->groOff = DP_MAX_DGRAM_SZ - extra;
+    } else {
+        dp->groOff = DP_MAX_DGRAM_SZ + (seg - first);
+    }
+    return (seg < first) ? seg : first;
+}
+
+/*
+ * Copies the next datagram of a coalesced run to buff
+*/
+static int dpgronext(dp_connp dp, void *buff, int buff_sz){
+    int n = dp->groLen - dp->groOff;
+
+    if (n > dp->groSeg)
+        n = dp->groSeg;
+    memcpy(buff, dp->groBuf + dp->groOff, (n < buff_sz) ? n : buff_sz);
+    dp->groOff += n;
+    return (n < buff_sz) ? n : buff_sz;
+}
+
+/*
+ * Initiate the send process.
+ * Since the entire file is now in the buffer,
+   the buffer will be looped 512 bytes at a time.
+ * A pointer to the file buffer will increment 512
+   bytes at a time until there is less than that left.
+ * dpsenddgram() will recieve that file pointer and
+   enforce the 512 byte cap for the datagram.
+ * After that, a check will be done to make sure that
+   the amount sent matches the size of the file.
  * Finally, the amount sent will be returned.
 */
-int dpsend(dp_connp dp, void *sbuff, int sbuff_sz){
+ssize_t dpsend(dp_connp dp, void *sbuff, size_t sbuff_sz){
+    struct iovec iov = { .iov_base = sbuff, .iov_len = sbuff_sz };
+    return dpsendv(dp, &iov, 1);
+}
+
+/*
+ * Same as dpsend(), but the message is the buffers of iov one after
+   the other.  Datagrams are gathered straight from them, a datagram may
+   span the end of one buffer and the start of the next.
+*/
+ssize_t dpsendv(dp_connp dp, const struct iovec *iov, int iovcnt){
 
-    void *sptr = sbuff;
-    int totalToSend = sbuff_sz;
-    int amountSent = 0;
+    size_t sbuff_sz = dpiovlen(iov, iovcnt);
+    size_t totalToSend = sbuff_sz;
+    size_t off = 0;
+    ssize_t amountSent = 0;
     int curSend = 0;
 
+    // Start a fresh delivery rate sample, idle time before this send does not count
+    dp->rateStart = dpnow();
+    dp->rateSeq = dp->seqNum;
+    dp->peerAckSeq = dp->seqNum;
+
+    // Kept for retransmits until the send is over
+    dp->txIov = iov;
+    dp->txIovCnt = iovcnt;
+    dp->txBase = dp->seqNum;
+    dp->txLen = sbuff_sz;
+
+    if (dp->fecN > 0 && !dp->reliable && !dp->shmUp) {
+        amountSent = dpsendfec(dp, iov, iovcnt, sbuff_sz);
+        dp->txIov = NULL;
+        dpzcflush(dp);
+        return amountSent;
+    }
+
     // Loop until the entire file is sent
     while(totalToSend > 0) {
 
-        curSend = dpsenddgram(dp, sptr, totalToSend);
+        curSend = dpsendgso(dp, iov, iovcnt, off, totalToSend);
         if(curSend < 0) {
+            dp->txIov = NULL;
+            dpzcflush(dp);
             return curSend;
         }
         
         amountSent += curSend;
         totalToSend -= curSend;
-        sptr += curSend;
+        off += curSend;
 
     }
 
+    dp->txIov = NULL;
+    // The caller may reuse its buffers once this returns
+    dpzcflush(dp);
+
     // Ensure that the amount sent is the same as the buffer size
-    if(amountSent != sbuff_sz) {
-        printf("Error: sent %d bytes, should have sent %d bytes\n", amountSent, sbuff_sz);
+    if((size_t)amountSent != sbuff_sz) {
+        printf("Error: sent %zd bytes, should have sent %zu bytes\n", amountSent, sbuff_sz);
     }
 
     return amountSent;
@@ -403,50 +1429,66 @@ int dpsend(dp_connp dp, void *sbuff, int sbuff_sz){
  * Send PDU and raw data, recieve an ACK PDU back.
  * First, the method will ensure that if the buffer is larger
    than 512 bytes, it will only send the first 512 bytes.
- * Next, the out PDU will be built and attached to the raw data
-   while also determining if the mtype is a fragment or regular send.
+ * Next, the out PDU will be built and the data (starting off bytes
+   into iov) is gathered behind it, while also determining if the
+   mtype is a fragment or regular send.
  * Then, the PDU + data will be sent out.
  * After this, the sequence number will be approrpiately updated.
- * Finally, an in PDU will be recieved with the ACK information
-   and the number of bytes of data (not including the PDU) will be returned.
+ * Finally, if this is the last datagram of the buffer or ackEvery
+   fragments have gone out since the last ACK, the cumulative ACK is
+   awaited, and the number of bytes of data (not including the PDU)
+   will be returned.
 */
-static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz){
+static int dpsenddgram(dp_connp dp, const struct iovec *iov, int iovcnt, size_t off, size_t sbuff_sz){
+    struct iovec dgIov[1 + DP_MAX_DGRAM_IOV];
     int bytesOut = 0;
     bool isFragment = false;
-    int totalToSend = sbuff_sz;
-    int mTypeExpected = 0;
+    int totalToSend;
 
     if(!dp->outSockAddr.isAddrInit) {
         perror("dpsend:dp connection not setup properly");
         return DP_ERROR_GENERAL;
     }
 
-    // Only send 512 bytes at a time
-    if(sbuff_sz > DP_MAX_BUFF_SZ) {
+    // Only send a fragment (512 bytes, more on local sockets) at a time
+    if(sbuff_sz > (size_t)dp->fragSz) {
         isFragment = true;
-        totalToSend = DP_MAX_BUFF_SZ;
+        totalToSend = dp->fragSz;
+    } else {
+        totalToSend = sbuff_sz;
+    }
+
+    // Never more unacknowledged data than the receiver said it can take
+    if(dp->txUnacked > 0 && (int64_t)(dp->seqNum - dp->peerAckSeq) + totalToSend > dp->peerWnd) {
+        dp->txUnacked = 0;
+        int rc = dpwaitack(dp);
+        if (rc < 0)
+            return rc;
     }
 
-    //Build the PDU and out buffer
+    //Build the PDU, the data stays where it is
     dp_pdu *outPdu = (dp_pdu *)_dpBuffer;
+    bzero(outPdu, sizeof(dp_pdu));
     outPdu->proto_ver = DP_PROTO_VER_1;
     outPdu->dgram_sz = totalToSend;
     outPdu->seqnum = dp->seqNum;
 
-    // If fragment, out and in mtypes should be fragments
-    // else, out and in mtypes should be regular sends
+    // If fragment, the out mtype should be a fragment
+    // else, the out mtype should be a regular send
     if(isFragment) {
         outPdu->mtype = DP_MT_SNDFRAG;
-        mTypeExpected = DP_MT_SNDFRAGACK;
+    } else if(dp->closeOnLast) {
+        outPdu->mtype = DP_MT_SNDCLOSE;
     } else {
         outPdu->mtype = DP_MT_SND;
-        mTypeExpected = DP_MT_SNDACK;
     }
 
-    memcpy((_dpBuffer + sizeof(dp_pdu)), sbuff, totalToSend);
+    dgIov[0].iov_base = outPdu;
+    dgIov[0].iov_len = sizeof(dp_pdu);
+    int n = dpgather(iov, iovcnt, off, totalToSend, dgIov + 1, _dpBuffer + sizeof(dp_pdu));
 
     int totalSendSz = outPdu->dgram_sz + sizeof(dp_pdu); // will add 20 (size of dp_pdu) to the file size
-    bytesOut = dpsendraw(dp, _dpBuffer, totalSendSz);
+    bytesOut = dpsendrawv(dp, dgIov, n + 1, dpzcflags(dp, dgIov + 1, _dpBuffer + sizeof(dp_pdu)));
 
     if(bytesOut != totalSendSz){
         printf("Warning send %d, but expected %d!\n", bytesOut, totalSendSz);
@@ -458,36 +1500,303 @@ static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz){
     else
         dp->seqNum += outPdu->dgram_sz;
 
-    //need to get an ack
-    dp_pdu inPdu = {0};
-    int bytesIn = dprecvraw(dp, &inPdu, sizeof(dp_pdu)); // where it will get the ACK
-    if ((bytesIn < sizeof(dp_pdu)) && (inPdu.mtype != mTypeExpected)){
-        printf("Expected SND/ACK but got a different mtype %d\n", inPdu.mtype);
-    }
+    //need to get an ack, fragments only every so often
+    if(isFragment && ++dp->txUnacked < dp->ackEvery)
+        return bytesOut - sizeof(dp_pdu);
+    dp->txUnacked = 0;
+
+    int bytesIn = dpwaitack(dp); // where it will get the ACK
+    if (bytesIn < 0)
+        return bytesIn;
 
     return bytesOut - sizeof(dp_pdu);
 }
 
 
+/*
+ * Sends a run of datagrams starting off bytes into iov with a single
+   sendmsg(), UDP_SEGMENT has the kernel cut it into DP_MAX_DGRAM_SZ
+   datagrams.  Each datagram is its PDU followed by its payload gathered
+   from iov, so every one but the last of the message is exactly a
+   segment long.
+ * The run stops where dpsenddgram() would wait for an ACK, which is then
+   awaited the same way.  Whatever cannot make a run of two or more
+   datagrams goes to dpsenddgram(), as does everything once the kernel
+   refused a run and every send zero copy applies to, as the run's
+   headers and spill buffers are reused before a completion could come.
+ * Returns the payload bytes sent, or a dp error.
+*/
+static int dpsendgso(dp_connp dp, const struct iovec *iov, int iovcnt, size_t off, size_t sbuff_sz){
+#ifdef UDP_SEGMENT
+    static dp_pdu hdrs[DP_GSO_SEGS];
+    static char spill[DP_GSO_SEGS][DP_MAX_BUFF_SZ];
+    static struct iovec gIov[DP_GSO_MAX_IOV];
+    char ctrl[CMSG_SPACE(sizeof(uint16_t))] = {0};
+    struct msghdr msg = {0};
+    struct cmsghdr *c;
+    int segs, built = 0, frags = 0, nIov = 0, total = 0, bytesOut;
+    size_t sent = 0, sz;
+    bool last = false;
+
+    if (!dp->gso || dp->shmUp || dp->dropPct > 0 || sbuff_sz <= DP_MAX_BUFF_SZ || dp->ackEvery - dp->txUnacked < 2 ||
+            (dp->zeroCopy && sbuff_sz >= DP_ZC_MIN_SZ))
+        return dpsenddgram(dp, iov, iovcnt, off, sbuff_sz);
+    if (!dp->outSockAddr.isAddrInit) {
+        perror("dpsend:dp connection not setup properly");
+        return DP_ERROR_GENERAL;
+    }
+
+    // Never more unacknowledged data than the receiver said it can take
+    if (dp->txUnacked > 0 && (int64_t)(dp->seqNum - dp->peerAckSeq) + DP_MAX_BUFF_SZ > dp->peerWnd) {
+        dp->txUnacked = 0;
+        int rc = dpwaitack(dp);
+        if (rc < 0)
+            return rc;
+    }
+    segs = dp->ackEvery - dp->txUnacked;
+    if (segs > DP_GSO_SEGS)
+        segs = DP_GSO_SEGS;
+    if (segs > (dp->peerWnd - (int64_t)(dp->seqNum - dp->peerAckSeq)) / DP_MAX_BUFF_SZ)
+        segs = (dp->peerWnd - (int64_t)(dp->seqNum - dp->peerAckSeq)) / DP_MAX_BUFF_SZ;
+    if (segs < 2)
+        return dpsenddgram(dp, iov, iovcnt, off, sbuff_sz);
+
+    for (int i = 0; i < segs && !last && nIov + 1 + DP_MAX_DGRAM_IOV <= DP_GSO_MAX_IOV; i++, built++) {
+        sz = sbuff_sz - sent;
+        if (sz > DP_MAX_BUFF_SZ)
+            sz = DP_MAX_BUFF_SZ;
+        last = (sent + sz == sbuff_sz);
+
+        bzero(&hdrs[i], sizeof(dp_pdu));
+        hdrs[i].proto_ver = DP_PROTO_VER_1;
+        hdrs[i].seqnum = dp->seqNum + sent;
+        hdrs[i].dgram_sz = sz;
+        if (!last) {
+            hdrs[i].mtype = DP_MT_SNDFRAG;
+            frags++;
+        } else {
+            hdrs[i].mtype = dp->closeOnLast ? DP_MT_SNDCLOSE : DP_MT_SND;
+        }
+        gIov[nIov].iov_base = &hdrs[i];
+        gIov[nIov++].iov_len = sizeof(dp_pdu);
+        nIov += dpgather(iov, iovcnt, off + sent, sz, gIov + nIov, spill[i]);
+        sent += sz;
+        total += sizeof(dp_pdu) + sz;
+    }
+
+    if (dp->isConnected && dp->keepAliveMs > 0)
+        dptimerstart(&dp->keepTimer, dp->keepAliveMs);
+    dppace(dp, total);
+
+    msg.msg_name = &(dp->outSockAddr.addr);
+    msg.msg_namelen = dp->outSockAddr.len;
+    msg.msg_iov = gIov;
+    msg.msg_iovlen = nIov;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = IPPROTO_UDP;
+    c->cmsg_type = UDP_SEGMENT;
+    c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *(uint16_t *)CMSG_DATA(c) = DP_MAX_DGRAM_SZ;
+
+    bytesOut = sendmsg(dp->udp_sock, &msg, 0);
+    if (bytesOut < 0 && errno != EINTR && errno != ENOBUFS && errno != EAGAIN) {
+        printf("dpsend: no UDP segmentation offload (%s), sending datagram by datagram\n", strerror(errno));
+        dp->gso = false;
+        return dpsenddgram(dp, iov, iovcnt, off, sbuff_sz);
+    }
+    if (bytesOut != total)
+        printf("Warning send %d, but expected %d!\n", bytesOut, total);
+    for (int i = 0; i < built; i++)
+        print_out_pdu(&hdrs[i]);
+
+    // Lost or not, the run is in flight now, retransmits recover it
+    dp->seqNum += sent;
+    dp->txUnacked += frags;
+    if (!last && dp->txUnacked < dp->ackEvery)
+        return sent;
+    dp->txUnacked = 0;
+
+    int bytesIn = dpwaitack(dp);
+    if (bytesIn < 0)
+        return bytesIn;
+    return sent;
+#else
+    return dpsenddgram(dp, iov, iovcnt, off, sbuff_sz);
+#endif
+}
+
+/*
+ * Sends a buffer as FEC groups.
+ * Each group is up to fecN full sized data datagrams (only the very last
+   one of the buffer can be short) sent back to back, followed by up to
+   fecK parity datagrams.  Parity j is built while the data goes out by
+   XORing in every data datagram i with (i % fecK) == j, the dgram_sz and
+   mtype of those datagrams are XORed into the parity PDU as well so that
+   a rebuilt datagram also gets its size and fragment flag back.
+ * Only one ACK is awaited per group, the receiver sends it once it has
+   every data datagram or was able to rebuild the missing ones.
+*/
+static ssize_t dpsendfec(dp_connp dp, const struct iovec *iov, int iovcnt, size_t sbuff_sz){
+    static char parity[DP_FEC_MAX_K][DP_MAX_BUFF_SZ];
+    int parityLen[DP_FEC_MAX_K], parityMtype[DP_FEC_MAX_K];
+    struct iovec dgIov[1 + DP_MAX_DGRAM_IOV];
+    dp_pdu *outPdu = (dp_pdu *)_dpBuffer;
+    size_t off = 0;
+    size_t remaining = sbuff_sz;
+    ssize_t amountSent = 0;
+
+    if(!dp->outSockAddr.isAddrInit) {
+        perror("dpsend:dp connection not setup properly");
+        return DP_ERROR_GENERAL;
+    }
+
+    while (remaining > 0) {
+        uint64_t base = dp->seqNum;
+        int n = dp->fecN;
+        int k = dp->fecK;
+        if (remaining < (size_t)n * DP_MAX_BUFF_SZ)
+            n = (remaining + DP_MAX_BUFF_SZ - 1) / DP_MAX_BUFF_SZ;
+        // a group is unacknowledged until it is complete, keep it inside the window
+        if (n * DP_MAX_BUFF_SZ > dp->peerWnd)
+            n = (dp->peerWnd / DP_MAX_BUFF_SZ > 0) ? dp->peerWnd / DP_MAX_BUFF_SZ : 1;
+        if (k > n)
+            k = n;
+
+        bzero(parity, sizeof(parity));
+        bzero(parityLen, sizeof(parityLen));
+        bzero(parityMtype, sizeof(parityMtype));
+
+        for (int i = 0; i < n; i++) {
+            int sz = (remaining > DP_MAX_BUFF_SZ) ? DP_MAX_BUFF_SZ : remaining;
+
+            bzero(outPdu, sizeof(dp_pdu));
+            outPdu->proto_ver = DP_PROTO_VER_1;
+            outPdu->mtype = (remaining > DP_MAX_BUFF_SZ) ? DP_MT_SNDFRAG : DP_MT_SND;
+            outPdu->seqnum = dp->seqNum;
+            outPdu->dgram_sz = sz;
+            outPdu->fec_n = n;
+            outPdu->fec_k = k;
+            outPdu->fec_idx = i;
+            outPdu->fec_base = base;
+            dgIov[0].iov_base = outPdu;
+            dgIov[0].iov_len = sizeof(dp_pdu);
+            int cnt = dpgather(iov, iovcnt, off, sz, dgIov + 1, _dpBuffer + sizeof(dp_pdu));
+
+            int zc = dpzcflags(dp, dgIov + 1, _dpBuffer + sizeof(dp_pdu));
+            if (dpsendrawv(dp, dgIov, cnt + 1, zc) != sizeof(dp_pdu) + sz)
+                printf("Warning FEC data datagram %d was not fully sent\n", i);
+
+            for (int p = 1, pos = 0; p <= cnt; pos += dgIov[p].iov_len, p++)
+                dpxor(parity[i % k] + pos, dgIov[p].iov_base, dgIov[p].iov_len);
+            parityLen[i % k] ^= sz;
+            parityMtype[i % k] ^= outPdu->mtype;
+
+            dp->seqNum += sz;
+            off += sz;
+            remaining -= sz;
+            amountSent += sz;
+        }
+
+        for (int j = 0; j < k; j++) {
+            bzero(outPdu, sizeof(dp_pdu));
+            outPdu->proto_ver = DP_PROTO_VER_1;
+            outPdu->mtype = DP_MT_PARITY;
+            outPdu->seqnum = base;
+            outPdu->dgram_sz = DP_MAX_BUFF_SZ;
+            outPdu->fec_n = n;
+            outPdu->fec_k = k;
+            outPdu->fec_idx = n + j;
+            outPdu->fec_base = base;
+            outPdu->fec_len = parityLen[j];
+            outPdu->fec_mtype = parityMtype[j];
+            memcpy(_dpBuffer + sizeof(dp_pdu), parity[j], DP_MAX_BUFF_SZ);
+
+            if (dpsendraw(dp, _dpBuffer, DP_MAX_DGRAM_SZ) != DP_MAX_DGRAM_SZ)
+                printf("Warning FEC parity datagram %d was not fully sent\n", j);
+        }
+
+        //one ACK covers the whole group
+        int bytesIn = dpwaitack(dp);
+        if (bytesIn < 0) {
+            printf("No SND/ACK for FEC group at %" PRIu64 "\n", base);
+            return bytesIn;
+        }
+    }
+
+    return amountSent;
+}
+
 /*
  * Send raw data to a socket.
  * Will connect to the udp socket and send the data from the buffer.
- * sendto() will wait until a connection is established and data is sent.
+ * sendmsg() will wait until a connection is established and data is sent.
  * Once the connection is established and the data is send, the current PDU
    will be printed (if in debug mode), and the number of bytes sent is returned.
 */
 static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
+    struct iovec iov = { .iov_base = sbuff, .iov_len = sbuff_sz };
+    return dpsendrawv(dp, &iov, 1, 0);
+}
+
+/*
+ * Same as dpsendraw(), but the datagram is gathered from the buffers of
+   iov with sendmsg(), the first one starts with the PDU.
+ * flags are MSG_ZEROCOPY from dpzcflags() or 0.
+*/
+static int dpsendrawv(dp_connp dp, struct iovec *iov, int iovcnt, int flags){
     int bytesOut = 0;
+    int sbuff_sz = dpiovlen(iov, iovcnt);
+    struct msghdr msg = {0};
 
     if(!dp->outSockAddr.isAddrInit) {
         perror("dpsendraw:dp connection not setup properly");
         return -1;
     }
 
-    dp_pdu *outPdu = sbuff;
-    bytesOut = sendto(dp->udp_sock, (const char *)sbuff, sbuff_sz, 
-        0, (const struct sockaddr *) &(dp->outSockAddr.addr), 
-            dp->outSockAddr.len); 
+    dp_pdu *outPdu = iov[0].iov_base;
+
+    if (dp->isConnected && dp->keepAliveMs > 0)
+        dptimerstart(&dp->keepTimer, dp->keepAliveMs);
+
+    if (outPdu->dgram_sz > 0)
+        dppace(dp, sbuff_sz);
+
+    //Simulate a lossy link by pretending data datagrams went out
+    if (dp->dropPct > 0 && outPdu->dgram_sz > 0 && dprand(dp->dropPct)) {
+        if (_debugMode == 1)
+            printf("PDU DROPPED (simulated loss)\n");
+        return sbuff_sz;
+    }
+
+    // A full ring loses the datagram, retransmits recover it
+    if (dp->shmUp) {
+        bytesOut = dmsend(dp->shm, iov, iovcnt);
+        if (bytesOut == DM_ERROR_FULL)
+            bytesOut = sbuff_sz;
+        print_out_pdu(outPdu);
+        return bytesOut;
+    }
+
+    msg.msg_name = &(dp->outSockAddr.addr);
+    msg.msg_namelen = dp->outSockAddr.len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    if (flags != 0)
+        flags = dpzcprep(dp, iov);
+    bytesOut = sendmsg(dp->udp_sock, &msg, flags);
+    // Zero copy fails with ENOBUFS once the pinned pages hit the
+    // socket's optmem limit, the datagram still has to go out
+    if (bytesOut < 0 && flags != 0) {
+        flags = 0;
+        bytesOut = sendmsg(dp->udp_sock, &msg, 0);
+    }
+    if (bytesOut >= 0 && flags != 0) {
+        dp->zcBusy[(dp->zcNext % DP_ZC_HDRS) / 64] |= 1ULL << (dp->zcNext % 64);
+        dp->zcNext++;
+        dp->zcPending++;
+    }
 
     
     print_out_pdu(outPdu);
@@ -495,6 +1804,555 @@ static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
     return bytesOut;
 }
 
+/*
+ * MSG_ZEROCOPY if a data datagram whose payload dpgather() put in payload
+   should go out zero copy: it is on, the message is large enough and the
+   payload is still in the caller's buffers rather than copied to spill.
+*/
+static int dpzcflags(dp_connp dp, const struct iovec *payload, const char *spill){
+#ifdef MSG_ZEROCOPY
+    if (dp->zeroCopy && !dp->shmUp && dp->txLen >= DP_ZC_MIN_SZ && payload->iov_base != spill)
+        return MSG_ZEROCOPY;
+#endif
+    return 0;
+}
+
+static bool dpzcbusy(dp_connp dp, uint32_t id){
+    return (dp->zcBusy[(id % DP_ZC_HDRS) / 64] >> (id % 64)) & 1;
+}
+
+/*
+ * Moves the PDU of a zero copy send to the header slot of its id, the
+   kernel reads it after sendmsg() has returned.  Returns the flags to
+   send with, 0 when the slot did not come free and the datagram is
+   better copied.
+*/
+static int dpzcprep(dp_connp dp, struct iovec *iov){
+    uint32_t slot = dp->zcNext % DP_ZC_HDRS;
+
+    while (dpzcbusy(dp, dp->zcNext))
+        if (dpzcreap(dp, DP_ZC_WAIT_MS) == 0)
+            return 0;
+    memcpy(&dp->zcHdrs[slot], iov[0].iov_base, sizeof(dp_pdu));
+    iov[0].iov_base = &dp->zcHdrs[slot];
+#ifdef MSG_ZEROCOPY
+    return MSG_ZEROCOPY;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Collects zero copy completions from the socket's error queue, waiting
+   up to wait_ms for the first one if none is there (0 only looks).
+ * Each completion covers the range of send ids ee_info..ee_data, their
+   header slots are free again afterwards.  Returns the sends completed.
+*/
+static int dpzcreap(dp_connp dp, int wait_ms){
+    int done = 0;
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+    char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct pollfd pfd = { .fd = dp->udp_sock, .events = 0 };
+    struct msghdr msg;
+    struct cmsghdr *c;
+
+    while (1) {
+        bzero(&msg, sizeof(msg));
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        if (recvmsg(dp->udp_sock, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR)
+                continue;
+            // POLLERR is always reported, nothing needs to be asked for
+            if (done > 0 || wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0)
+                break;
+            wait_ms = 0;
+            continue;
+        }
+
+        for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+            if (!(c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) &&
+                    !(c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(c);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            for (uint32_t id = ee->ee_info; ; id++) {
+                if (dpzcbusy(dp, id)) {
+                    dp->zcBusy[(id % DP_ZC_HDRS) / 64] &= ~(1ULL << (id % 64));
+                    dp->zcPending--;
+                    done++;
+                }
+                if (id == ee->ee_data)
+                    break;
+            }
+
+            if (!(ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)) {
+                dp->zcCopied = 0;
+            } else if (++dp->zcCopied == DP_ZC_COPIED_MAX && dp->zeroCopy) {
+                printf("dpsend: the kernel copies zero copy sends anyway, turning zero copy off\n");
+                dp->zeroCopy = false;
+            }
+        }
+    }
+#endif
+    return done;
+}
+
+/*
+ * Waits until every zero copy send has completed, the buffers they were
+   sent from are the caller's again then
+*/
+static void dpzcflush(dp_connp dp){
+    while (dp->zcPending > 0) {
+        if (dpzcreap(dp, DP_ZC_WAIT_MS) == 0) {
+            printf("dpsend: %d zero copy sends did not complete\n", dp->zcPending);
+            return;
+        }
+    }
+}
+
+/*
+ * True if addr is this host, traffic to it goes over loopback
+*/
+static bool dpislocal(struct sockaddr_in *addr){
+    struct sockaddr_in self;
+    socklen_t len = sizeof(self);
+    bool local;
+    int s;
+
+    if ((ntohl(addr->sin_addr.s_addr) >> 24) == 127)
+        return true;
+    // The kernel picks the source address of a route, for a local
+    // address that is the address itself
+    if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return false;
+    local = connect(s, (struct sockaddr *)addr, sizeof(*addr)) == 0 &&
+            getsockname(s, (struct sockaddr *)&self, &len) == 0 &&
+            self.sin_addr.s_addr == addr->sin_addr.s_addr;
+    close(s);
+    return local;
+}
+
+/*
+ * Client: creates a same host link and offers it to the server, see the
+   notes in du-proto.h.  Returns the token for the CONNECT, 0 if there is
+   no link to offer.
+*/
+static uint64_t dpshmoffer(dp_connp dp){
+    char name[32];
+    uint64_t token = 0;
+    FILE *f;
+
+    if (dp->reliable)
+        return 0;
+    dpshmdrop(dp);
+    if (dp->shmOff || dp->dropPct > 0 || !dpislocal(&dp->outSockAddr.addr)) {
+        dpsetfrag(dp, DP_MAX_BUFF_SZ);
+        return 0;
+    }
+    if (dpsetfrag(dp, DP_UNIX_BUFF_SZ) != DP_NO_ERROR)
+        return 0;
+
+    f = fopen("/dev/urandom", "rb");
+    if (f == NULL || fread(&token, sizeof(token), 1, f) != 1)
+        token = dpnow() ^ ((uint64_t)getpid() << 32);
+    if (f != NULL)
+        fclose(f);
+    if (token == 0)
+        token = 1;
+
+    snprintf(name, sizeof(name), DP_SHM_NAME, ntohs(dp->outSockAddr.addr.sin_port));
+    dp->shm = malloc(sizeof(dm_link));
+    if (dp->shm == NULL || dmcreate(dp->shm, DP_SHM_SLOTS, DP_UNIX_DGRAM_SZ, token) != DM_NO_ERROR ||
+            dmoffer(dp->shm, name) != DM_NO_ERROR) {
+        dpshmdrop(dp);
+        dpsetfrag(dp, DP_MAX_BUFF_SZ);
+        return 0;
+    }
+    return token;
+}
+
+/*
+ * Server: takes the link offered with token, if there is one
+*/
+static bool dpshmaccept(dp_connp dp, uint64_t token){
+    if (token == 0 || dp->shmOff || dp->dropPct > 0 || dp->shmSock < 0)
+        return false;
+    dpshmdrop(dp);
+    if (dpsetfrag(dp, DP_UNIX_BUFF_SZ) != DP_NO_ERROR)
+        return false;
+    dp->shm = malloc(sizeof(dm_link));
+    if (dp->shm == NULL || dmaccept(dp->shm, dp->shmSock, token) != DM_NO_ERROR ||
+            dp->shm->slotSz < DP_UNIX_DGRAM_SZ) {
+        dpshmdrop(dp);
+        dpsetfrag(dp, DP_MAX_BUFF_SZ);
+        return false;
+    }
+    dpshmup(dp);
+    return true;
+}
+
+static void dpshmup(dp_connp dp){
+    dp->shmUp = true;
+    printf("Using the same host link\n");
+}
+
+static void dpshmdrop(dp_connp dp){
+    if (dp->shm != NULL) {
+        dmclose(dp->shm);
+        free(dp->shm);
+    }
+    dp->shm = NULL;
+    dp->shmUp = false;
+}
+
+/*
+ * Current time from the monotonic clock in nanoseconds
+*/
+static uint64_t dpnow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The process wide timer wheel, set up on first use
+*/
+static dt_wheel *dpwheel(){
+    if (!_dpWheelInit) {
+        dtinit(&_dpWheel, dpms());
+        _dpWheelInit = true;
+    }
+    return &_dpWheel;
+}
+
+static uint64_t dpms(){
+    return dpnow() / 1000000;
+}
+
+/*
+ * (Re)starts a timer to fire ms milliseconds from now
+*/
+static void dptimerstart(dt_timer *t, int ms){
+    dtstart(dpwheel(), t, dpms() + ms);
+}
+
+static void dptimerstop(dt_timer *t){
+    dtstop(dpwheel(), t);
+}
+
+/*
+ * Starts the keepalive and idle timers of a connection that was just
+   established, if they are turned on
+*/
+static void dpstarttimers(dp_connp dp){
+    if (dp->keepAliveMs > 0)
+        dptimerstart(&dp->keepTimer, dp->keepAliveMs);
+    if (dp->idleMs > 0)
+        dptimerstart(&dp->idleTimer, dp->idleMs);
+}
+
+/*
+ * Nothing was ACKed within rto, back off and send it all again
+*/
+static void dprtxtimer(dt_timer *t, void *arg){
+    dp_connp dp = arg;
+
+    if (++dp->rtxCount > DP_MAX_RETRIES) {
+        dp->timedOut = true;
+        return;
+    }
+    dp->rto = (dp->rto * 2 < DP_RTO_MAX_MS) ? dp->rto * 2 : DP_RTO_MAX_MS;
+    if (_debugMode == 1)
+        printf("RETRANSMIT #%d, rto now %d ms\n", dp->rtxCount, dp->rto);
+    dpretransmit(dp);
+    dptimerstart(t, dp->rto);
+}
+
+/*
+ * The delayed ACK is due
+*/
+static void dpacktimer(dt_timer *t, void *arg){
+    dp_connp dp = arg;
+
+    if (dp->rxUnacked > 0)
+        dpsendack(dp, DP_MT_SNDFRAGACK, DP_NO_ERROR);
+}
+
+/*
+ * Nothing was sent for a while, a bare ACK tells the peer this side
+   is still there (dpsendraw() starts the timer again)
+*/
+static void dpkeeptimer(dt_timer *t, void *arg){
+    dp_connp dp = arg;
+    dp_pdu pdu = {0};
+
+    pdu.proto_ver = DP_PROTO_VER_1;
+    pdu.mtype = DP_MT_ACK;
+    pdu.seqnum = dp->seqNum;
+    pdu.rwnd = dp->lastWnd;
+    dpsendraw(dp, &pdu, sizeof(pdu));
+}
+
+/*
+ * Nothing was received for idleMs, the peer is gone
+*/
+static void dpidletimer(dt_timer *t, void *arg){
+    dp_connp dp = arg;
+
+    if (_debugMode == 1)
+        printf("IDLE TIMEOUT after %d ms\n", dp->idleMs);
+    dp->timedOut = true;
+}
+
+/*
+ * Updates the smoothed round trip time and its variation with a new
+   sample (ns) and derives rto from them as RFC 6298 does
+*/
+static void dprttsample(dp_connp dp, uint64_t rtt){
+    long r = rtt / 1000;
+    long rto;
+
+    if (dp->srtt == 0) {
+        dp->srtt = r > 0 ? r : 1;
+        dp->rttVar = r / 2;
+    } else {
+        dp->rttVar = (3 * dp->rttVar + labs(dp->srtt - r)) / 4;
+        dp->srtt = (7 * dp->srtt + r) / 8;
+    }
+
+    rto = (dp->srtt + 4 * dp->rttVar) / 1000;
+    if (rto < DP_RTO_MIN_MS)
+        rto = DP_RTO_MIN_MS;
+    if (rto > DP_RTO_MAX_MS)
+        rto = DP_RTO_MAX_MS;
+    dp->rto = rto;
+}
+
+/*
+ * Works out how much payload the socket receive buffer can hold.
+ * The kernel charges every datagram for its buffer overhead as well, which
+   for small datagrams is as much as the data itself, so only a quarter of
+   SO_RCVBUF is counted on.
+ * Also asks the kernel to report its drop count with every datagram.
+*/
+static void dpinitwnd(dp_connp dp){
+    int on = 1;
+    socklen_t len = sizeof(int);
+
+#ifdef SO_RXQ_OVFL
+    setsockopt(dp->udp_sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#endif
+    getsockopt(dp->udp_sock, SOL_SOCKET, SO_SNDBUF, &dp->sndBuf, &len);
+    len = sizeof(int);
+    if (getsockopt(dp->udp_sock, SOL_SOCKET, SO_RCVBUF, &dp->rcvBuf, &len) == 0 && dp->rcvBuf > 0)
+        dp->sockWnd = dp->rcvBuf / 4;
+    if (dp->sockWnd < DP_MAX_BUFF_SZ)
+        dp->sockWnd = DP_MAX_BUFF_SZ;
+}
+
+/*
+ * Grows the SO_SNDBUF or SO_RCVBUF (opt) of the socket to bytes, capped at
+   sockBufMax, and reads back what the kernel actually gave.
+ * Linux reports twice the size that was set (the other half is for its
+   bookkeeping), so a buffer that reports bytes or more is left alone.
+*/
+static void dpsockbuf(dp_connp dp, int opt, long bytes){
+    int *cur = (opt == SO_RCVBUF) ? &dp->rcvBuf : &dp->sndBuf;
+    int sz;
+    socklen_t len = sizeof(int);
+
+    if (dp->sockBufMax <= 0)
+        return;
+    if (bytes > dp->sockBufMax)
+        bytes = dp->sockBufMax;
+    if (bytes <= *cur / 2)
+        return;
+    sz = bytes;
+
+#if defined(SO_RCVBUFFORCE) && defined(SO_SNDBUFFORCE)
+    if (setsockopt(dp->udp_sock, SOL_SOCKET, (opt == SO_RCVBUF) ? SO_RCVBUFFORCE : SO_SNDBUFFORCE, 
+                    &sz, sizeof(sz)) != 0)
+#endif
+        setsockopt(dp->udp_sock, SOL_SOCKET, opt, &sz, sizeof(sz));
+
+    getsockopt(dp->udp_sock, SOL_SOCKET, opt, cur, &len);
+    if (opt == SO_RCVBUF && *cur / 4 > dp->sockWnd)
+        dp->sockWnd = *cur / 4;
+}
+
+/*
+ * Sizes a socket buffer from the bandwidth-delay product, rate is in
+   bytes per second.  Nothing happens until there is an RTT sample.
+*/
+static void dptunebufs(dp_connp dp, int opt, double rate){
+    double bdp;
+
+    if (dp->srtt == 0 || rate <= 0)
+        return;
+    bdp = rate * dp->srtt / 1e6;
+    if (bdp > dp->sockBufMax)
+        bdp = dp->sockBufMax;       // dpsockbuf() caps it, only keep the long in range
+    dpsockbuf(dp, opt, (long)(bdp * DP_SOCKBUF_GAIN));
+}
+
+/*
+ * Payload the socket receive buffer can still take on top of what is
+   queued in it.  SO_MEMINFO counts every queued datagram with its
+   overhead, against the buffer size that is counted the same way, so
+   the room left is scaled like sockWnd.  FIONREAD, where SO_MEMINFO is
+   missing, only sees the datagram at the head of the queue.
+*/
+static int dpsockwnd(dp_connp dp){
+    long room = dp->sockWnd;
+#ifdef SO_MEMINFO
+    uint32_t mem[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(mem);
+
+    if (getsockopt(dp->udp_sock, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0)
+        room = ((long)mem[SK_MEMINFO_RCVBUF] - (long)mem[SK_MEMINFO_RMEM_ALLOC]) / 4;
+    else
+#endif
+    {
+        int queued = 0;
+        if (ioctl(dp->udp_sock, FIONREAD, &queued) == 0)
+            room = dp->sockWnd - queued;
+    }
+    if (room > dp->sockWnd)
+        room = dp->sockWnd;
+    return (room > 0) ? room : 0;
+}
+
+/*
+ * Window to advertise in an ACK of type mtype.
+ * While fragments of a send are still coming in it is the room left in
+   the caller's buffer, otherwise what the socket can still hold with
+   what is already queued in it.  It is never less than one datagram so
+   the sender can always make progress.
+*/
+static int dpwindow(dp_connp dp, int mtype){
+    int wnd = dp->shmUp ? DP_SHM_WND : dp->reliable ? DP_UNIX_WND : dpsockwnd(dp);
+
+    if (mtype == DP_MT_SNDFRAGACK && dp->rxSpace >= 0 && dp->rxSpace < wnd)
+        wnd = dp->rxSpace;
+    if (wnd < dp->fragSz)
+        wnd = dp->fragSz;
+    return wnd;
+}
+
+/*
+ * SipHash-2-4 of len bytes of in under a 128 bit key
+*/
+#define DP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define DP_SIPROUND(v0, v1, v2, v3) do {                                    \
+        v0 += v1; v1 = DP_ROTL(v1, 13); v1 ^= v0; v0 = DP_ROTL(v0, 32);     \
+        v2 += v3; v3 = DP_ROTL(v3, 16); v3 ^= v2;                           \
+        v0 += v3; v3 = DP_ROTL(v3, 21); v3 ^= v0;                           \
+        v2 += v1; v1 = DP_ROTL(v1, 17); v1 ^= v2; v2 = DP_ROTL(v2, 32);     \
+    } while (0)
+
+static uint64_t dpsiphash(const uint64_t key[2], const unsigned char *in, int len){
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+    uint64_t m, b = (uint64_t)len << 56;
+    int i;
+
+    for (; len >= 8; in += 8, len -= 8) {
+        for (m = 0, i = 7; i >= 0; i--)
+            m = (m << 8) | in[i];
+        v3 ^= m;
+        DP_SIPROUND(v0, v1, v2, v3);
+        DP_SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    for (i = len - 1; i >= 0; i--)
+        b |= (uint64_t)in[i] << (8 * i);
+
+    v3 ^= b;
+    DP_SIPROUND(v0, v1, v2, v3);
+    DP_SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    for (i = 0; i < 4; i++)
+        DP_SIPROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * Cookie for the CONNECT in pdu, which came from the address in
+   outSockAddr, during the given epoch
+*/
+static uint64_t dpcookie(dp_connp dp, const dp_pdu *pdu, uint32_t epoch){
+    unsigned char in[20];
+    struct sockaddr_in *peer = &dp->outSockAddr.addr;
+
+    memcpy(in, &peer->sin_addr.s_addr, 4);
+    memcpy(in + 4, &peer->sin_port, 2);
+    in[6] = in[7] = 0;
+    memcpy(in + 8, &pdu->seqnum, 8);
+    memcpy(in + 16, &epoch, 4);
+    return dpsiphash(dp->cookieKey, in, sizeof(in));
+}
+
+/*
+ * Token bucket in front of the socket.
+ * Refills the bucket for the time that passed since the last datagram,
+   then sleeps just long enough for bytes worth of tokens to be there.
+ * Does nothing if pacing is off, or in auto mode until there is a
+   delivery rate to pace at.
+*/
+static void dppace(dp_connp dp, int bytes){
+    double rate = dp->paceRate;
+    uint64_t now;
+
+    if (dp->paceRate == DP_PACE_AUTO) {
+        if (dp->rateEst <= 0)
+            return;
+        rate = dp->rateEst * DP_PACE_GAIN_PCT / 100;
+        if (rate < DP_PACE_MIN_RATE)
+            rate = DP_PACE_MIN_RATE;
+    }
+    if (rate <= 0)
+        return;
+
+    now = dpnow();
+    dp->paceTokens += (now - dp->paceLast) * rate / 1e9;
+    if (dp->paceTokens > dp->paceBurst)
+        dp->paceTokens = dp->paceBurst;
+    dp->paceLast = now;
+
+    if (dp->paceTokens < bytes) {
+        uint64_t waitNs = (bytes - dp->paceTokens) * 1e9 / rate;
+        struct timespec ts = { .tv_sec = waitNs / 1000000000ULL, .tv_nsec = waitNs % 1000000000ULL };
+        nanosleep(&ts, NULL);
+        now = dpnow();
+        dp->paceTokens += (now - dp->paceLast) * rate / 1e9;
+        dp->paceLast = now;
+    }
+    dp->paceTokens -= bytes;
+}
+
+/*
+ * Folds the data ACKed since the start of the current sample into the
+   measured delivery rate (a moving average), then starts a new sample.
+*/
+static void dpratesample(dp_connp dp){
+    uint64_t now = dpnow();
+    uint64_t acked = dp->seqNum - dp->rateSeq;
+    double sample;
+
+    if (now > dp->rateStart && acked >= DP_MAX_BUFF_SZ) {
+        sample = acked * 1e9 / (now - dp->rateStart);
+        dp->rateEst = (dp->rateEst <= 0) ? sample : (7 * dp->rateEst + sample) / 8;
+    }
+    dp->rateStart = now;
+    dp->rateSeq = dp->seqNum;
+}
+
 /*
  * Starts the server, waits for a request from the client,
    and sends an acknowlegement to the client.
@@ -520,15 +2378,51 @@ int dplisten(dp_connp dp) {
     dp_pdu pdu = {0};
 
     printf("Waiting for a connection...\n");
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
-    if (rcvSz != sizeof(pdu)) {
-        perror("dplisten:The wrong number of bytes were received");
-        return DP_ERROR_GENERAL;
+    while (1) {
+        rcvSz = dprecvraw(dp, _dpBuffer, sizeof(_dpBuffer));
+        memcpy(&pdu, _dpBuffer, sizeof(pdu));
+        if (rcvSz < (int)sizeof(pdu) || pdu.mtype != DP_MT_CONNECT ||
+                pdu.dgram_sz < 0 || pdu.dgram_sz > DP_MAX_BUFF_SZ ||
+                rcvSz != sizeof(pdu) + pdu.dgram_sz) {
+            if (dp->useCookies)
+                continue;       // strays are dropped while waiting
+            perror("dplisten:The wrong number of bytes were received");
+            return DP_ERROR_GENERAL;
+        }
+
+        // Nobody can forge the sender of a local datagram
+        if (!dp->useCookies || dp->reliable)
+            break;
+        uint32_t epoch = time(0) / DP_COOKIE_EPOCH_S;
+        if (pdu.cookie != 0 && (pdu.cookie == dpcookie(dp, &pdu, epoch) ||
+                pdu.cookie == dpcookie(dp, &pdu, epoch - 1)))
+            break;
+
+        // No (valid) cookie yet, hand one out and keep nothing
+        pdu.mtype = DP_MT_CNTNACK;
+        pdu.dgram_sz = 0;
+        pdu.cookie = dpcookie(dp, &pdu, epoch);
+        if (dpsendraw(dp, &pdu, sizeof(pdu)) != sizeof(pdu))
+            perror("dplisten:The wrong number of bytes were sent");
     }
 
+    // Keep any 0-RTT data for the first dprecv()
+    memcpy(dp->early, _dpBuffer + sizeof(pdu), pdu.dgram_sz);
+    dp->earlySz = pdu.dgram_sz;
+    dp->connSeq = pdu.seqnum;
+
     pdu.mtype = DP_MT_CNTACK;
-    dp->seqNum = pdu.seqnum + 1;
+    // Taking the client's link makes the CNTACK the first datagram over it
+    if (!dpshmaccept(dp, pdu.shm_token))
+        pdu.shm_token = 0;
+    //Control only CONNECTs count as one, with data they count their size
+    dp->seqNum = pdu.seqnum + (pdu.dgram_sz > 0 ? pdu.dgram_sz : 1);
+    dp->connAckSeq = dp->seqNum;
     pdu.seqnum = dp->seqNum;
+    pdu.dgram_sz = 0;
+    pdu.rwnd = dpwindow(dp, DP_MT_CNTACK);
+    if (pdu.rwnd > 0)
+        dp->lastWnd = pdu.rwnd;
     
     sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
     
@@ -537,7 +2431,8 @@ int dplisten(dp_connp dp) {
         return DP_ERROR_GENERAL;
     }
     dp->isConnected = true; 
-    //For non data transmissions, ACK of just control data increase seq # by one
+    dp->rxEndSeq = dp->seqNum;
+    dpstarttimers(dp);
     printf("Connection established OK!\n");
 
     return true;
@@ -555,6 +2450,15 @@ int dplisten(dp_connp dp) {
  * Finally, the method will return true to acknowledge the connection.
 */
 int dpconnect(dp_connp dp) {
+    return dpconnectdata(dp, NULL, 0);
+}
+
+/*
+ * Same as dpconnect(), but sbuff (at most DP_MAX_BUFF_SZ bytes) goes
+   along with the CONNECT PDU and is the first message the server gets.
+ * The CNTACK then acknowledges the data as well.
+*/
+int dpconnectdata(dp_connp dp, void *sbuff, size_t sbuff_sz) {
 
     int sndSz, rcvSz;
 
@@ -562,31 +2466,72 @@ int dpconnect(dp_connp dp) {
         perror("dpconnect:dp connection not setup properly - svr struct not init");
         return DP_ERROR_GENERAL;
     }
+    if (sbuff_sz > DP_MAX_BUFF_SZ)
+        return DP_BUFF_OVERSIZED;
 
-    dp_pdu pdu = {0};
-    pdu.mtype = DP_MT_CONNECT;
-    pdu.seqnum = dp->seqNum;
-    pdu.dgram_sz = 0;
+    // Offered before a pool buffer is taken, the offer resizes the pool
+    uint64_t token = dpshmoffer(dp);
+    char *ctl = dbget(&dp->pool);
+    if (ctl == NULL)
+        return DP_ERROR_GENERAL;
+    dp_pdu *outPdu = (dp_pdu *)ctl;
+    bzero(outPdu, sizeof(dp_pdu));
+    outPdu->proto_ver = DP_PROTO_VER_1;
+    outPdu->mtype = DP_MT_CONNECT;
+    outPdu->seqnum = dp->seqNum;
+    outPdu->dgram_sz = sbuff_sz;
+    outPdu->shm_token = token;
+    if (sbuff_sz > 0)
+        memcpy(ctl + sizeof(dp_pdu), sbuff, sbuff_sz);
+
+    // A server that wants a cookie answers with one, the same
+    // CONNECT then goes out again echoing it
+    dp_pdu pdu;
+    for (int tries = 0; ; tries++) {
+        sndSz = dpsendraw(dp, ctl, sizeof(dp_pdu) + sbuff_sz);
+        // A local server that is not up yet has no socket to send to,
+        // the CONNECT counts as lost and the retransmit timer resends it
+        if (sndSz < 0 && dp->reliable && (errno == ENOENT || errno == ECONNREFUSED))
+            sndSz = sizeof(dp_pdu) + sbuff_sz;
+        if (sndSz != sizeof(dp_pdu) + sbuff_sz) {
+            perror("dpconnect:Wrong about of connection data sent");
+            dbput(ctl);
+            return -1;
+        }
 
-    sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
-    if (sndSz != sizeof(dp_pdu)) {
-        perror("dpconnect:Wrong about of connection data sent");
-        return -1;
-    }
-    
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
-    if (rcvSz != sizeof(dp_pdu)) {
-        perror("dpconnect:Wrong about of connection data received");
-        return -1;
+        rcvSz = dpwaitctl(dp, ctl, sizeof(dp_pdu) + sbuff_sz, &pdu);
+        if (rcvSz != sizeof(dp_pdu)) {
+            perror("dpconnect:Wrong about of connection data received");
+            dbput(ctl);
+            return -1;
+        }
+        if (pdu.mtype != DP_MT_CNTNACK || tries >= DP_COOKIE_TRIES)
+            break;
+        outPdu->cookie = pdu.cookie;
     }
+    dbput(ctl);
     if (pdu.mtype != DP_MT_CNTACK) {
         perror("dpconnect:Expected CNTACT Message but didnt get it");
         return -1;
     }
 
+    // The server took the link if it echoes the token
+    if (token != 0 && pdu.shm_token == token) {
+        dpshmup(dp);
+    } else {
+        dpshmdrop(dp);
+        if (token != 0)
+            dpsetfrag(dp, DP_MAX_BUFF_SZ);
+    }
+
+    if (pdu.rwnd > 0)
+        dp->peerWnd = pdu.rwnd;
+
     //For non data transmissions, ACK of just control data increase seq # by one
-    dp->seqNum++;
+    dp->seqNum += (sbuff_sz > 0) ? sbuff_sz : 1;
+    dp->rxEndSeq = dp->seqNum;
     dp->isConnected = true;
+    dpstarttimers(dp);
     printf("Connection established OK!\n");
 
     return true;
@@ -603,19 +2548,25 @@ int dpdisconnect(dp_connp dp) {
 
     int sndSz, rcvSz;
 
-    dp_pdu pdu = {0};
-    pdu.proto_ver = DP_PROTO_VER_1;
-    pdu.mtype = DP_MT_CLOSE;
-    pdu.seqnum = dp->seqNum;
-    pdu.dgram_sz = 0;
+    dp_pdu pdu;
+    dp_pdu *outPdu = dbget(&dp->pool);
+    if (outPdu == NULL)
+        return DP_ERROR_GENERAL;
+    bzero(outPdu, sizeof(dp_pdu));
+    outPdu->proto_ver = DP_PROTO_VER_1;
+    outPdu->mtype = DP_MT_CLOSE;
+    outPdu->seqnum = dp->seqNum;
+    outPdu->dgram_sz = 0;
 
-    sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
+    sndSz = dpsendraw(dp, outPdu, sizeof(dp_pdu));
     if (sndSz != sizeof(dp_pdu)) {
         perror("dpdisconnect:Wrong about of connection data sent");
+        dbput(outPdu);
         return DP_ERROR_GENERAL;
     }
     
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
+    rcvSz = dpwaitctl(dp, outPdu, sizeof(dp_pdu), &pdu);
+    dbput(outPdu);
     if (rcvSz != sizeof(dp_pdu)) {
         perror("dpdisconnect:Wrong about of connection data received");
         return DP_ERROR_GENERAL;
@@ -630,6 +2581,42 @@ int dpdisconnect(dp_connp dp) {
     return DP_CONNECTION_CLOSED;
 }
 
+/*
+ * Sends a final message and closes the connection with it.
+ * The last datagram carries DP_MT_CLOSE, so the ACK of the message is
+   also the CLOSEACK and no extra round trip is needed.  FEC groups have
+   no room for the flag, with FEC on (or nothing left to send) this falls
+   back to dpsend() followed by dpdisconnect().
+ * The connection is freed either way.
+*/
+ssize_t dpsendlast(dp_connp dp, void *sbuff, size_t sbuff_sz) {
+    struct iovec iov = { .iov_base = sbuff, .iov_len = sbuff_sz };
+    return dpsendlastv(dp, &iov, 1);
+}
+
+/*
+ * Same as dpsendlast(), with the message gathered from the buffers of iov
+*/
+ssize_t dpsendlastv(dp_connp dp, const struct iovec *iov, int iovcnt) {
+    size_t sbuff_sz = dpiovlen(iov, iovcnt);
+    ssize_t rc;
+
+    if (dp->fecN > 0 || sbuff_sz == 0) {
+        rc = (sbuff_sz > 0) ? dpsendv(dp, iov, iovcnt) : 0;
+        if (rc < 0) {
+            dpclose(dp);
+            return rc;
+        }
+        dpdisconnect(dp);
+        return rc;
+    }
+
+    dp->closeOnLast = true;
+    rc = dpsendv(dp, iov, iovcnt);
+    dpclose(dp);
+    return rc;
+}
+
 /*
  * Will copy a PDU to a buffer
    and return the location where the
@@ -648,6 +2635,110 @@ void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz) {
 
 
 //// MISC HELPERS
+/*
+ * Total size of the buffers of an iovec array
+*/
+static size_t dpiovlen(const struct iovec *iov, int iovcnt){
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+/*
+ * Points out[] at the len bytes that start off bytes into iov and
+   returns how many entries that took.
+ * If they are spread over more than DP_MAX_DGRAM_IOV buffers they are
+   copied into spill instead (which must hold len bytes) and out[0]
+   points there.
+*/
+static int dpgather(const struct iovec *iov, int iovcnt, size_t off, size_t len, struct iovec *out, char *spill){
+    size_t pos = off, left = len;
+    int i = 0, n = 0;
+
+    while (i < iovcnt && pos >= iov[i].iov_len)
+        pos -= iov[i++].iov_len;
+
+    for (; left > 0 && i < iovcnt; i++, pos = 0) {
+        size_t take = iov[i].iov_len - pos;
+        if (take > left)
+            take = left;
+        if (take == 0)
+            continue;
+        if (n == DP_MAX_DGRAM_IOV) {
+            dpiovread(iov, iovcnt, off, spill, len);
+            out[0].iov_base = spill;
+            out[0].iov_len = len;
+            return 1;
+        }
+        out[n].iov_base = (char *)iov[i].iov_base + pos;
+        out[n].iov_len = take;
+        n++;
+        left -= take;
+    }
+    return n;
+}
+
+/*
+ * Copies len bytes that start off bytes into iov out to dst
+*/
+static void dpiovread(const struct iovec *iov, int iovcnt, size_t off, void *dst, size_t len){
+    char *d = dst;
+    int i = 0;
+
+    while (i < iovcnt && off >= iov[i].iov_len)
+        off -= iov[i++].iov_len;
+    for (; len > 0 && i < iovcnt; i++, off = 0) {
+        size_t take = iov[i].iov_len - off;
+        if (take > len)
+            take = len;
+        memcpy(d, (char *)iov[i].iov_base + off, take);
+        d += take;
+        len -= take;
+    }
+}
+
+/*
+ * Copies len bytes from src into iov, starting off bytes into it
+*/
+static void dpiovwrite(const struct iovec *iov, int iovcnt, size_t off, const void *src, size_t len){
+    const char *s = src;
+    int i = 0;
+
+    while (i < iovcnt && off >= iov[i].iov_len)
+        off -= iov[i++].iov_len;
+    for (; len > 0 && i < iovcnt; i++, off = 0) {
+        size_t take = iov[i].iov_len - off;
+        if (take > len)
+            take = len;
+        memcpy((char *)iov[i].iov_base + off, s, take);
+        s += take;
+        len -= take;
+    }
+}
+
+/*
+ * XORs len bytes of src into dst.
+ * Works 16 bytes at a time with GCC vector types, which map onto
+   SSE2/NEON registers, and finishes the tail a byte at a time.
+*/
+typedef unsigned char dp_vec __attribute__((vector_size(16)));
+static void dpxor(void *dst, const void *src, int len){
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    int i = 0;
+
+    for (; i + (int)sizeof(dp_vec) <= len; i += sizeof(dp_vec)) {
+        dp_vec a, b;
+        memcpy(&a, d + i, sizeof(dp_vec));
+        memcpy(&b, s + i, sizeof(dp_vec));
+        a ^= b;
+        memcpy(d + i, &a, sizeof(dp_vec));
+    }
+    for (; i < len; i++)
+        d[i] ^= s[i];
+}
+
 /*
  * Calls the PDU print method to
    print outgoing PDU attributes
@@ -679,7 +2770,11 @@ static void print_pdu_details(dp_pdu *pdu){
     printf("\tVersion:  %d\n", pdu->proto_ver);
     printf("\tMsg Type: %s\n", pdu_msg_to_string(pdu));
     printf("\tMsg Size: %d\n", pdu->dgram_sz);
-    printf("\tSeq Numb: %d\n", pdu->seqnum);
+    printf("\tSeq Numb: %" PRIu64 "\n", pdu->seqnum);
+    if (pdu->mtype & DP_MT_ACK)
+        printf("\tWindow:   %d\n", pdu->rwnd);
+    if (IS_FEC_PDU(pdu))
+        printf("\tFEC:      %d of %d+%d at %" PRIu64 "\n", pdu->fec_idx, pdu->fec_n, pdu->fec_k, pdu->fec_base);
     printf("\n");
 }
 
@@ -702,7 +2797,13 @@ static char * pdu_msg_to_string(dp_pdu *pdu) {
         case DP_MT_SNDACK:
             return "SEND/ACK";    
         case DP_MT_CNTACK:
-            return "CONNECT/ACK";    
+            return "CONNECT/ACK";
+        case DP_MT_CNTNACK:
+            return "CONNECT/NACK";    
+        case DP_MT_SNDCLOSE:
+            return "SEND/CLOSE";
+        case DP_MT_SNDCLOSEACK:
+            return "SEND/CLOSE/ACK";
         case DP_MT_CLOSEACK:
             return "CLOSE/ACK";
         // Now includes fragment mtypes
@@ -710,6 +2811,8 @@ static char * pdu_msg_to_string(dp_pdu *pdu) {
             return "SENDFRAG";
         case DP_MT_SNDFRAGACK:
             return "SENDFRAG/ACK";
+        case DP_MT_PARITY:
+            return "PARITY";
         default:
             return "***UNKNOWN***";  
     }
@@ -735,11 +2838,15 @@ int dprand(int threshold){
         return 0;
     if (threshold > 99)
         return 1;
-    //initialize randome number seed
-    srand(time(0));
+    //initialize randome number seed, only once so the calls are not all the same
+    static bool seeded = false;
+    if (!seeded) {
+        srand(time(0) ^ getpid());
+        seeded = true;
+    }
 
     int rndInRange = (rand() % (100-1+1)) + 1;
-    if (threshold < rndInRange)
+    if (rndInRange <= threshold)
         return 1;
     else
         return 0;
@@ -1,22 +1,394 @@
 #pragma once
 
+#include <stdint.h>
+#include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 
+#include "du-timer.h"
+#include "du-pool.h"
+#include "du-shm.h"
+
 
 struct dp_sock{
     socklen_t          len;
     _Bool              isAddrInit;
-    struct sockaddr_in addr;
+    union {
+        struct sockaddr_in addr;
+        struct sockaddr_un unAddr;      //local socket connections, the larger of the two
+    };
+};
+
+/*
+ * Delayed ACKs
+ * Fragments are ACKed cumulatively, once every ackEvery of them.  The
+   receiver also ACKs right away on the last datagram of a send, on data
+   that is out of sequence, and when nothing more arrives within
+   DP_ACK_DELAY_MS of a fragment it still owes an ACK for.
+ */
+#define DP_DEF_ACK_EVERY 4
+#define DP_ACK_DELAY_MS  10
+
+/*
+ * Timers
+ * The timers of every dp_connection in the process live on one timer
+   wheel (du-timer.h) with millisecond ticks.  dprecvraw() polls the
+   socket only until the next timer is due and advances the wheel, so
+   they fire whichever connection happens to be waiting.
+ *      retransmit  data that is not ACKed within rto is sent again from
+                    the last cumulative ACK on (go-back-N), as is a
+                    CONNECT or CLOSE that gets no answer.  rto follows the
+                    measured round trip time like TCP's (RFC 6298),
+                    doubles on every retransmit and gives up with
+                    DP_ERROR_TIMEOUT after DP_MAX_RETRIES.  DP_DUPACK_THRESH
+                    duplicate ACKs retransmit without waiting.
+ *      delayed ACK see above
+ *      keepalive   a bare ACK goes out after keepAliveMs without sending
+ *      idle        DP_ERROR_TIMEOUT after idleMs without receiving
+ */
+#define DP_RTO_INIT_MS      1000
+#define DP_RTO_MIN_MS       200
+#define DP_RTO_MAX_MS       8000
+#define DP_MAX_RETRIES      8
+#define DP_DUPACK_THRESH    3
+
+/*
+ * Flow control
+ * Every ACK carries rwnd, the number of bytes past its seqnum the receiver
+   can take.  Within a send that is the room left in the buffer passed to
+   dprecv(), at the end of a send it is what the socket receive buffer can
+   still hold, less what already waits in it, until the application calls
+   dprecv() again.  The sender never has
+   more than rwnd bytes unacknowledged, and the receiver ACKs as soon as
+   the sender could not fit another full datagram, so a slow reader holds
+   the sender back instead of overflowing the socket.
+ */
+#define DP_DEF_RWND      (16 * DP_MAX_BUFF_SZ)
+
+/*
+ * Socket buffers
+ * The kernel's default socket buffers hold a few hundred KB, a burst
+   larger than that is dropped before du-proto ever sees it.  Both
+   buffers are grown (never shrunk) to DP_SOCKBUF_GAIN times the
+   bandwidth-delay product, the smoothed RTT times the measured rate: the
+   delivery rate from the ACKs for SO_SNDBUF, the rate messages arrive at
+   for SO_RCVBUF.  Whenever the kernel reports drops the receive buffer
+   is doubled on top of that.  SO_*BUFFORCE is tried first so the sizes
+   are not capped by net.core.[rw]mem_max when running privileged.
+ * dpsetsockbuf() sets the ceiling, 0 leaves the kernel's sizes alone.
+ * Datagrams the kernel dropped because the receive buffer was full are
+   counted through SO_RXQ_OVFL and returned by dprxdrops().
+ */
+#define DP_SOCKBUF_GAIN     2
+#define DP_SOCKBUF_MAX      (8 * 1024 * 1024)
+
+/*
+ * 0-RTT connect and piggybacked close
+ * dpconnectdata() carries a first message of up to DP_MAX_BUFF_SZ bytes
+   on the CONNECT PDU, dplisten() keeps it and the next dprecv() returns
+   it, so a request does not have to wait for the CNTACK round trip.
+   Since a CONNECT may be duplicated on the way, the server remembers the
+   CONNECT it answered and never delivers its data twice, the data should
+   still be something that is safe to act on twice (like a hello).
+ * dpsendlast() sends a final message and marks its last datagram with
+   DP_MT_CLOSE, the peer gets the data from dprecv() and
+   DP_CONNECTION_CLOSED from the call after it, which saves the separate
+   CLOSE/CLOSEACK round trip.
+ */
+
+/*
+ * Vectored I/O
+ * dpsendv() sends the buffers of an iovec array as one message and
+   dprecvv() fills the buffers of one in order, so a header, metadata and
+   data can live in separate buffers.  dpsend() and dprecv() are the same
+   calls with a single buffer.
+ * Datagrams are gathered straight from the caller's buffers with
+   sendmsg(), only a datagram that would span more than DP_MAX_DGRAM_IOV
+   buffers is copied together first.  The buffers must stay untouched
+   until the call returns, retransmits read from them again.
+ * Receiving still copies: every datagram is read into _dpBuffer, where
+   its PDU decides whether and where the payload belongs, and the
+   payload is copied from there into the caller's buffers.
+ */
+#define DP_MAX_DGRAM_IOV 16
+
+/*
+ * Busy polling
+ * Waking up from a blocking receive costs tens of microseconds of
+   scheduler latency.  With dpsetbusypoll() dprecvraw() first spins on a
+   MSG_DONTWAIT recvmsg() for up to busyPollUs before it sleeps in poll(),
+   and the socket gets SO_BUSY_POLL with the same budget so the kernel
+   polls the device queue instead of waiting for its interrupt.  This
+   burns a core while waiting and is meant for latency sensitive
+   request/response traffic.  DP_BUSY_POLL_DEF_US is a sensible budget.
+ */
+#define DP_BUSY_POLL_DEF_US 50
+
+/*
+ * Zero copy sends
+ * With dpsetzerocopy() the data datagrams of a dpsendv() of at least
+   DP_ZC_MIN_SZ bytes go out with MSG_ZEROCOPY: the kernel pins the
+   caller's pages instead of copying them and reports on the socket's
+   error queue once it is done with them.  The PDU of such a datagram is
+   kept in one of DP_ZC_HDRS header slots until its completion is in, and
+   dpsendv() does not return before every zero copy send of the message
+   has completed, so the caller can reuse or unmap its buffers as before.
+ * Datagrams whose payload had to be copied together (see Vectored I/O)
+   and FEC parity go out the normal way.
+ * Where the kernel cannot avoid the copy (loopback, devices without
+   scatter-gather) it copies anyway and says so in the completion, after
+   DP_ZC_COPIED_MAX such completions in a row zero copy is turned off
+   again as it only adds the notifications then.  Pinning pays off with
+   large datagrams, for DP_MAX_BUFF_SZ ones it saves little.
+ */
+#define DP_ZC_MIN_SZ        16384
+#define DP_ZC_HDRS          256
+#define DP_ZC_COPIED_MAX    16
+#define DP_ZC_WAIT_MS       1000
+
+/*
+ * Segmentation offload
+ * Where the kernel has UDP_SEGMENT (Linux 4.18) dpsendv() hands it a run
+   of up to DP_GSO_SEGS datagrams in one sendmsg(), laid out back to back
+   as full DP_MAX_DGRAM_SZ segments with only the last one of the message
+   shorter, and the kernel cuts them apart.  The stack is walked once per
+   run instead of once per datagram, which is most of the cost of sending
+   small datagrams.  Payloads are still gathered from the caller's buffers.
+ * A run ends where the sender waits for an ACK anyway (ackEvery
+   fragments, the peer's window, the end of the message), so raising
+   ackEvery gives longer runs.
+ * It is on by default.  A kernel or device that refuses the segment size
+   turns it off for the connection and the run goes out a datagram at a
+   time, as do FEC groups, retransmits, simulated loss and zero copy
+   sends.  dpsetgso() turns it off and on.
+ */
+#define DP_GSO_SEGS         64
+#define DP_GSO_MAX_IOV      1024
+
+/*
+ * Receive offload
+ * With dpsetgro() the socket gets UDP_GRO: the kernel hands over a run
+   of equally sized datagrams from the peer (up to DP_GRO_BUF_SZ bytes,
+   one of the runs a GSO sender makes) in one recvmsg() and says in a
+   control message how long each of them was.  dprecvmsg() receives the
+   first one straight into the caller's buffer and the rest behind it
+   into the connection's GRO buffer, later dprecvraw() calls take them
+   from there one by one without going to the socket.
+ * It pays on the side that receives the bulk of the data, the other
+   side mostly gets single ACKs.  It is off by default.
+ */
+#define DP_GRO_BUF_SZ       65536
+
+/*
+ * Same host link
+ * A client whose server is on the same host (its address routes over
+   loopback) offers it a shared memory link (du-shm.h) as part of the
+   handshake: the memfd and eventfds go to the server over the AF_UNIX
+   socket DP_SHM_NAME of its port before the CONNECT, and the CONNECT
+   carries the offer's token in shm_token.  A server that took the offer
+   echoes the token in its CNTACK, from then on dpsendraw() puts every
+   datagram into the link instead of the UDP socket.  A server that did
+   not (another host after all, an older server, dpsetshm() off) answers
+   without the token and the client stays on UDP.
+ * Everything above dpsendraw() and dprecvraw() stays the same, ACKs,
+   windows and retransmits included, a datagram the full ring dropped is
+   recovered like one the network lost.  dprecvraw() keeps reading the
+   UDP socket as well, a CONNECT the client sends again before it has
+   its CNTACK still gets answered.
+ * A slot takes a datagram of DP_UNIX_DGRAM_SZ bytes and fragments carry
+   DP_UNIX_BUFF_SZ bytes over a link, as on a local socket: every
+   datagram costs a slot, a copy in and a copy out however small it is,
+   so a 64K message is one of them instead of 128.  Both sides grow their
+   pool (see Datagram buffers) before the offer is made or taken and
+   shrink it again if the link does not come up, so the two always agree
+   on the fragment size.
+ * Nothing gets lost on a link unless a ring fills up, so ACKs are only
+   flow control there.  Each side advertises half a ring, DP_SHM_WND,
+   instead of what the socket buffer holds, and FEC is not used.  A side
+   that simulates loss (dpsetloss()) stays on UDP, the loss is there to
+   exercise the retransmits.
+ */
+#define DP_SHM_NAME         "du-proto.%d"
+#define DP_SHM_SLOTS        64
+#define DP_SHM_WND          (DP_SHM_SLOTS / 2 * DP_UNIX_BUFF_SZ)
+
+/*
+ * Local sockets
+ * dpServerInitUnix() and dpClientInitUnix() run a connection over an
+   AF_UNIX datagram socket bound to a path instead of over UDP.  The
+   kernel delivers those datagrams in order and never drops one, a
+   sender whose peer has no room left blocks until it has, so such a
+   connection (reliable) needs none of the machinery for lost datagrams.
+ * Fragments carry up to DP_UNIX_BUFF_SZ bytes rather than
+   DP_MAX_BUFF_SZ, a 64K message is one datagram instead of 128, and
+   each side advertises DP_UNIX_WND as the socket buffer is not what
+   limits it.  Data is never retransmitted, the retransmit timer only
+   backs off until it gives up on a peer that went away (a CONNECT sent
+   before the server was there still goes out again).  FEC, segmentation
+   offload, the same host link and cookies (the sender of a local
+   datagram cannot be forged) are not used.  ACKs work as before, and
+   simulated loss (dpsetloss()) turns the retransmits back on.
+ * The server unlinks a stale socket at its path, one nobody answers a
+   connect() on, before binding to it, and the path again when it
+   closes.  A client whose CONNECT finds no socket at the path yet
+   treats it as lost and sends it again.  The client binds to an abstract
+   address the kernel picks, where the server's replies go.
+ */
+#define DP_UNIX_BUFF_SZ     65536
+#define DP_UNIX_WND         (4 * DP_UNIX_BUFF_SZ)
+
+/*
+ * Datagram buffers
+ * Every connection gets a pool (du-pool.h) of DP_POOL_BUFS buffers of
+   DP_MAX_DGRAM_SZ bytes (DP_UNIX_DGRAM_SZ on a local socket or a same
+   host link) when it is created, so datagrams that outlive the call that received or built
+   them, a CONNECT or CLOSE waiting to be
+   retransmitted or a data datagram put back for the next receive, never
+   need a malloc().  The code that builds a control datagram and the
+   retransmit slot each hold a reference to the same buffer.
+ * dpsetpool() resizes the pool and can put it on hugepages.
+ */
+#define DP_POOL_BUFS     32
+
+/*
+ * Handshake cookies
+ * With dpsetcookies() on, dplisten() answers a CONNECT that carries no
+   valid cookie with a CNTNACK holding one and forgets about it.  The
+   cookie is a SipHash-2-4 MAC, under a per-server random key, of the
+   client's address, port, initial seqnum and the current
+   DP_COOKIE_EPOCH_S second epoch.  Only a CONNECT that echoes it proves
+   the client can receive at its address, and only then is any
+   connection state kept, so a flood of bogus CONNECTs costs nothing but
+   the replies.  Cookies from the previous epoch are still accepted.
+ */
+#define DP_COOKIE_EPOCH_S   30
+#define DP_COOKIE_TRIES     2
+
+/*
+ * Send pacing
+ * Data datagrams go through a token bucket in dpsendraw() that fills at
+   paceRate bytes per second up to paceBurst bytes, a datagram that finds
+   too few tokens waits until enough have built up.  With DP_PACE_AUTO the
+   rate follows the delivery rate measured from the ACKs, with some
+   headroom (DP_PACE_GAIN_PCT) so the pace can still grow.
+ */
+#define DP_PACE_AUTO        -1
+#define DP_PACE_DEF_BURST   (4 * 1024)
+#define DP_PACE_GAIN_PCT    125
+#define DP_PACE_MIN_RATE    (64 * 1024)
+
+/*
+ * Forward error correction (FEC)
+ * When enabled on the sending side with dpsetfec(), dpsend() transmits
+   fragments in groups of up to fecN data datagrams followed by fecK parity
+   datagrams and only waits for one ACK per group.  Parity datagram j is the
+   XOR of every data datagram i in the group with (i % fecK) == j, so the
+   receiver can rebuild one lost datagram per parity class without a round
+   trip.  The receiver learns the group layout from the PDUs themselves.
+ */
+#define DP_MAX_BUFF_SZ   512
+#define DP_FEC_MAX_N     32
+#define DP_FEC_MAX_K     8
+
+//Receive side state of the FEC group being collected
+struct dp_fec_group {
+    _Bool              active;
+    uint64_t           base;                    //seqnum of the first data datagram
+    int                n;                       //data datagrams in the group
+    int                k;                       //parity datagrams in the group
+    unsigned int       haveData;                //bit i set once data datagram i is in
+    unsigned int       haveParity;              //bit j set once parity datagram j is in
+    int                len[DP_FEC_MAX_N];       //dgram_sz of each data datagram
+    int                mtype[DP_FEC_MAX_N];     //mtype of each data datagram
+    int                parityLen[DP_FEC_MAX_K];
+    int                parityMtype[DP_FEC_MAX_K];
+    char               parity[DP_FEC_MAX_K][DP_MAX_BUFF_SZ];
 };
 
 typedef struct dp_connection{
-    unsigned int       seqNum;
+    uint64_t           seqNum;          //byte offset in the session, never wraps
     int                udp_sock;
     _Bool              isConnected;
     struct dp_sock     outSockAddr;
     struct dp_sock     inSockAddr;
     int                dbgMode;
+    int                fecN;            //data datagrams per FEC group, 0 = off
+    int                fecK;            //parity datagrams per FEC group
+    int                dropPct;         //simulated loss of outgoing data datagrams
+    int                ackEvery;        //fragments per cumulative ACK
+    int                txUnacked;       //fragments sent since the last ACK
+    int                rxUnacked;       //fragments received but not ACKed yet
+    long               paceRate;        //bytes per second, 0 = off, DP_PACE_AUTO = measured
+    int                paceBurst;       //bucket depth in bytes
+    double             paceTokens;      //bytes that can go out right now
+    uint64_t           paceLast;        //when the bucket was last refilled (ns)
+    double             rateEst;         //measured delivery rate, bytes per second
+    uint64_t           rateStart;       //start of the current delivery rate sample (ns)
+    uint64_t           rateSeq;         //seqNum at the start of the sample
+    int                peerWnd;         //window the peer advertised in its last ACK
+    uint64_t           peerAckSeq;      //seqnum that window starts at
+    int                lastWnd;         //window this side advertised in its last ACK
+    uint64_t           lastAckSeq;      //seqnum of this side's last ACK
+    ssize_t            rxSpace;         //room left in the dprecv() buffer, -1 outside of dprecv()
+    int                sockWnd;         //payload the socket receive buffer can hold
+    int                sockBufMax;      //ceiling for tuning the socket buffers, 0 = off
+    int                sndBuf;          //SO_SNDBUF as the kernel reports it
+    int                rcvBuf;          //SO_RCVBUF as the kernel reports it
+    uint32_t           rxDrops;         //datagrams the kernel dropped on the socket
+    double             rxRateEst;       //rate messages arrive at, bytes per second
+    int                busyPollUs;      //spin this long before blocking, 0 = off
+    _Bool              gso;             //send runs of datagrams with UDP_SEGMENT
+    _Bool              reliable;        //AF_UNIX socket, nothing gets lost
+    _Bool              ownsPath;        //server: unlink inSockAddr's path on close
+    int                fragSz;          //payload of a full data datagram
+    dm_link            *shm;            //same host link, NULL if there is none
+    _Bool              shmUp;           //datagrams go out over shm
+    _Bool              shmOff;          //never offer or take a link
+    int                shmSock;         //server: where link offers arrive, -1 if none
+    _Bool              gro;             //UDP_GRO is on for the socket
+    char               *groBuf;         //datagrams received in a run, not handed out yet
+    int                groOff;          //next of them
+    int                groLen;          //end of them
+    int                groSeg;          //their size
+    _Bool              zeroCopy;        //send large messages with MSG_ZEROCOPY
+    struct dp_pdu      *zcHdrs;         //DP_ZC_HDRS header slots of zero copy sends
+    uint64_t           zcBusy[DP_ZC_HDRS / 64]; //slots whose send has not completed
+    uint32_t           zcNext;          //id the kernel gives the next zero copy send
+    int                zcPending;       //zero copy sends not completed yet
+    int                zcCopied;        //completions in a row the kernel copied anyway
+    uint64_t           connSeq;         //seqnum of the peer's CONNECT
+    uint64_t           connAckSeq;      //seqnum this side answered it with
+    _Bool              closeOnLast;     //dpsendlast() in progress
+    _Bool              peerClosed;      //peer closed on its last datagram
+    _Bool              useCookies;      //server: only accept CONNECTs that echo a cookie
+    uint64_t           cookieKey[2];    //server: secret the cookies are keyed with
+    int                earlySz;         //bytes in early, data that came with CONNECT
+    char               early[DP_MAX_BUFF_SZ];
+    dt_timer           rtxTimer;
+    dt_timer           ackTimer;        //delayed ACK
+    dt_timer           keepTimer;
+    dt_timer           idleTimer;
+    int                rto;             //retransmit timeout (ms)
+    long               srtt;            //smoothed round trip time (us), 0 = no sample yet
+    long               rttVar;          //round trip time variation (us)
+    uint64_t           rttStart;        //when this side started waiting for an ACK (ns)
+    int                rtxCount;        //retransmits while waiting for this ACK
+    int                keepAliveMs;     //0 = no keepalives
+    int                idleMs;          //0 = no idle timeout
+    _Bool              timedOut;        //retransmits or the idle timer gave up
+    const struct iovec *txIov;          //buffers of the dpsendv() in progress
+    int                txIovCnt;
+    uint64_t           txBase;          //seqnum of their first byte
+    size_t             txLen;
+    char               *rtxCtl;         //CONNECT or CLOSE waiting for its answer (pool buffer)
+    int                rtxCtlSz;
+    uint64_t           rxEndSeq;        //seqnum after the last message received in full
+    char               *stash;          //datagram put back for the next dprecvraw(), NULL if none
+    int                stashSz;
+    db_pool            pool;            //datagram buffers of this connection
+    struct dp_fec_group fecRx;
 } dp_connection;
 
 typedef struct dp_connection *dp_connp;
@@ -29,14 +401,14 @@ typedef struct dp_connection *dp_connp;
 
 //THIS IS HOW YOU DO A BIT FIELD
 //
-//   64  32  16  8   4   2   1
-// |---+---+---+---+---+---+---|
-//   E   F   N   C   C   S   A
-//   R   R   A   L   O   E   C
-//   R   A   C   O   N   N   K
-//   O   G   K   S   C   D
-//   R           E   T
-//-------------------------------
+//  128  64  32  16  8   4   2   1
+// |---+---+---+---+---+---+---+---|
+//   P   E   F   N   C   C   S   A
+//   A   R   R   A   L   O   E   C
+//   R   R   A   C   O   N   N   K
+//   I   O   G   K   S   C   D
+//   T   R           E   T
+//-----------------------------------
 #define DP_MT_ACK        1              //ACK MSG                                   00000001
 #define DP_MT_SND        2              //SND MSG                                   00000010
 #define DP_MT_CONNECT    4              //Connect MSG                               00000100
@@ -44,6 +416,7 @@ typedef struct dp_connection *dp_connp;
 #define DP_MT_NACK       16             //NEG ACK                                   00010000
 #define DP_MT_FRAGMENT   32             //DGRAM IS A FRAGMENT:                      00100000
 #define DP_MT_ERROR      64             //SIMULATE ERROR:                           01000000
+#define DP_MT_PARITY     128            //FEC PARITY DGRAM:                         10000000
 
 #define DP_MT_SNDFRAG (DP_MT_SND | DP_MT_FRAGMENT) // SEND FRAGMENT = 34            00100010
 
@@ -54,20 +427,42 @@ typedef struct dp_connection *dp_connp;
 
 #define DP_MT_SNDFRAGACK (DP_MT_SNDACK | DP_MT_FRAGMENT) // SEND FRAGMENT ACK = 35  00100011
 
+//Server asks the client to CONNECT again echoing the cookie it sent along
+#define DP_MT_CNTNACK   (DP_MT_CONNECT | DP_MT_NACK) // CONNECT NACK = 20           00010100
+
+//Last datagram of a send that also closes the connection, see dpsendlast()
+#define DP_MT_SNDCLOSE    (DP_MT_SND    | DP_MT_CLOSE) // SEND + CLOSE = 10         00001010
+#define DP_MT_SNDCLOSEACK (DP_MT_SNDACK | DP_MT_CLOSE) // SEND + CLOSE ACK = 11     00001011
+
 // determines if the current message type is a fragment
 // will return true as long as the bit in the 6th position is on (1)
 #define IS_MT_FRAGMENT(x) ((x & DP_MT_FRAGMENT) == DP_MT_FRAGMENT)
 
+// determines if the current datagram is part of an FEC group
+#define IS_FEC_PDU(p) ((p)->fec_n > 0)
+
 typedef struct dp_pdu {
     int     proto_ver;
     int     mtype;
-    int     seqnum;
+    uint64_t seqnum;            //byte offset of the first data byte (64 bit, never wraps)
     int     dgram_sz;
     int     err_num;
+    unsigned char fec_n;        //data datagrams in this FEC group, 0 if FEC is off
+    unsigned char fec_k;        //parity datagrams in this FEC group
+    unsigned char fec_idx;      //data are 0..n-1, parity n..n+k-1
+    unsigned char fec_rsvd;
+    int     rwnd;               //ACKs: bytes the receiver can take past seqnum
+    union {
+        uint64_t fec_base;      //seqnum of the first data datagram in the group
+        uint64_t shm_token;     //CONNECT and CNTACK: same host link offer, 0 if none
+    };
+    int     fec_len;            //parity only: XOR of the covered dgram_sz
+    int     fec_mtype;          //parity only: XOR of the covered mtypes
+    uint64_t cookie;            //CONNECT handshake cookie, see dpsetcookies()
 } dp_pdu;
 
-#define     DP_MAX_BUFF_SZ          512
-#define     DP_MAX_DGRAM_SZ         (DP_MAX_BUFF_SZ + sizeof(dp_pdu)) // 512 + 20 (five 4-byte ints) = 532
+#define     DP_MAX_DGRAM_SZ         (DP_MAX_BUFF_SZ + sizeof(dp_pdu)) // 512 + 56 byte header = 568
+#define     DP_UNIX_DGRAM_SZ        (DP_UNIX_BUFF_SZ + sizeof(dp_pdu))
 
 #define     DP_NO_ERROR             0
 #define     DP_ERROR_GENERAL        -1
@@ -76,29 +471,100 @@ typedef struct dp_pdu {
 #define     DP_BUFF_OVERSIZED       -8
 #define     DP_CONNECTION_CLOSED    -16
 #define     DP_ERROR_BAD_DGRAM      -32
-//#define     DP_ERROR_TIMEOUT        -64
+#define     DP_ERROR_TIMEOUT        -64
+#define     DP_ERROR_SEQUENCE       -128
 
 //PROTOTYPES - INTERNAL HELPERS
 static dp_connp dpinit();
 
 dp_connp dpServerInit(int port);
 dp_connp dpClientInit(char *addr, int port);
+dp_connp dpServerInitUnix(const char *path);
+dp_connp dpClientInitUnix(const char *path);
 static char * pdu_msg_to_string(dp_pdu *pdu);
 
 //API Interface
 void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz);
-int dprecv(dp_connp dp, void *buff, int buff_sz);
-int dpsend(dp_connp dp, void *sbuff, int sbuff_sz);
+ssize_t dprecv(dp_connp dp, void *buff, size_t buff_sz);
+ssize_t dpsend(dp_connp dp, void *sbuff, size_t sbuff_sz);
+ssize_t dprecvv(dp_connp dp, const struct iovec *iov, int iovcnt);
+ssize_t dpsendv(dp_connp dp, const struct iovec *iov, int iovcnt);
 int dplisten(dp_connp dp);
 int dpconnect(dp_connp dp);
+int dpconnectdata(dp_connp dp, void *sbuff, size_t sbuff_sz);
 int dpdisconnect(dp_connp dp);
+ssize_t dpsendlast(dp_connp dp, void *sbuff, size_t sbuff_sz);
+ssize_t dpsendlastv(dp_connp dp, const struct iovec *iov, int iovcnt);
 
 void dpclose(dp_connp dpsession);
 void print_out_pdu(dp_pdu *pdu);
 void print_in_pdu(dp_pdu *pdu);
 int  dpmaxdgram();
+int  dpsetfec(dp_connp dp, int n, int k);
+int  dpsetackevery(dp_connp dp, int n);
+int  dpsetpacing(dp_connp dp, long rate, int burst);
+void dpsetloss(dp_connp dp, int pct);
+int  dpsetcookies(dp_connp dp, int on);
+int  dpsettimers(dp_connp dp, int keepalive_ms, int idle_ms);
+int  dpsetpool(dp_connp dp, int count, int hugepages);
+int  dpsetsockbuf(dp_connp dp, int max_bytes);
+int  dpsetbusypoll(dp_connp dp, int usecs);
+int  dpsetzerocopy(dp_connp dp, int on);
+int  dpsetgso(dp_connp dp, int on);
+int  dpsetgro(dp_connp dp, int on);
+int  dpsetshm(dp_connp dp, int on);
+long dprxdrops(dp_connp dp);
+int  dprand(int threshold);
 static void print_pdu_details(dp_pdu *pdu);
+static void dpxor(void *dst, const void *src, int len);
 static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz);
+static int dpsendrawv(dp_connp dp, struct iovec *iov, int iovcnt, int flags);
+static int dpzcflags(dp_connp dp, const struct iovec *payload, const char *spill);
+static int dpzcprep(dp_connp dp, struct iovec *iov);
+static int dpzcreap(dp_connp dp, int wait_ms);
+static void dpzcflush(dp_connp dp);
 static int dprecvraw(dp_connp dp, void *buff, int buff_sz);
+static int dprecvmsg(dp_connp dp, void *buff, int buff_sz, int flags);
+static int dpgronext(dp_connp dp, void *buff, int buff_sz);
+static uint64_t dpshmoffer(dp_connp dp);
+static _Bool dpshmaccept(dp_connp dp, uint64_t token);
+static _Bool dpislocal(struct sockaddr_in *addr);
+static void dpshmup(dp_connp dp);
+static void dpshmdrop(dp_connp dp);
 static int dprecvdgram(dp_connp dp, void *buff, int buff_sz);
-static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz);
+static int dpsenddgram(dp_connp dp, const struct iovec *iov, int iovcnt, size_t off, size_t sbuff_sz);
+static int dpsendgso(dp_connp dp, const struct iovec *iov, int iovcnt, size_t off, size_t sbuff_sz);
+static ssize_t dpsendfec(dp_connp dp, const struct iovec *iov, int iovcnt, size_t sbuff_sz);
+static int dprecvfec(dp_connp dp, const struct iovec *iov, int iovcnt, size_t off, size_t buff_sz, _Bool *more);
+static int dpsendack(dp_connp dp, int mtype, int errCode);
+static int dprecvack(dp_connp dp, dp_pdu *pdu);
+static int dpwaitack(dp_connp dp);
+static int dpwaitctl(dp_connp dp, void *ctl, int ctl_sz, dp_pdu *pdu);
+static void dpretransmit(dp_connp dp);
+static void dprttsample(dp_connp dp, uint64_t rtt);
+static dt_wheel *dpwheel();
+static uint64_t dpms();
+static void dptimerstart(dt_timer *t, int ms);
+static void dptimerstop(dt_timer *t);
+static void dpstarttimers(dp_connp dp);
+static void dprtxtimer(dt_timer *t, void *arg);
+static void dpacktimer(dt_timer *t, void *arg);
+static void dpkeeptimer(dt_timer *t, void *arg);
+static void dpidletimer(dt_timer *t, void *arg);
+static void dppace(dp_connp dp, int bytes);
+static void dpratesample(dp_connp dp);
+static uint64_t dpnow();
+static int dpsockwnd(dp_connp dp);
+static int dpwindow(dp_connp dp, int mtype);
+static void dpinitwnd(dp_connp dp);
+static int dpsetfrag(dp_connp dp, int frag_sz);
+static _Bool dpunixinit(dp_connp dpc, struct dp_sock *addr, const char *path);
+static _Bool dpunixstale(struct dp_sock *addr);
+static void dpsockbuf(dp_connp dp, int opt, long bytes);
+static void dptunebufs(dp_connp dp, int opt, double rate);
+static uint64_t dpsiphash(const uint64_t key[2], const unsigned char *in, int len);
+static uint64_t dpcookie(dp_connp dp, const dp_pdu *pdu, uint32_t epoch);
+static size_t dpiovlen(const struct iovec *iov, int iovcnt);
+static int dpgather(const struct iovec *iov, int iovcnt, size_t off, size_t len, struct iovec *out, char *spill);
+static void dpiovread(const struct iovec *iov, int iovcnt, size_t off, void *dst, size_t len);
+static void dpiovwrite(const struct iovec *iov, int iovcnt, size_t off, const void *src, size_t len);
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include "du-queue.h"
+
+/*
+ * Sets up a ring of count slots of at least slot_sz bytes each.
+ * Returns DQ_ERROR_NOMEM if the slots cannot be allocated.
+*/
+int dqinit(dq_ring *q, int slot_sz, int count){
+    bzero(q, sizeof(dq_ring));
+    if (slot_sz <= 0 || count <= 0)
+        return DQ_ERROR_NOMEM;
+
+    q->slotSz = (slot_sz + DQ_ALIGN - 1) & ~(DQ_ALIGN - 1);
+    q->count = count;
+    q->slots = aligned_alloc(DQ_ALIGN, (size_t)q->slotSz * count);
+    if (q->slots == NULL) {
+        perror("dqinit: cannot allocate the ring");
+        return DQ_ERROR_NOMEM;
+    }
+    sem_init(&q->filled, 0, 0);
+    sem_init(&q->empty, 0, 0);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->prodWaiting, 0);
+    atomic_init(&q->consWaiting, 0);
+    return DQ_NO_ERROR;
+}
+
+/*
+ * Frees the ring, neither side may be using it any more
+*/
+void dqdestroy(dq_ring *q){
+    if (q->slots == NULL)
+        return;
+    sem_destroy(&q->filled);
+    sem_destroy(&q->empty);
+    free(q->slots);
+    q->slots = NULL;
+}
+
+static void dqwait(sem_t *s){
+    while (sem_wait(s) != 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * Sleeps on s until ready() holds.  The flag goes up before the last
+   look, a post that comes in between is kept by the semaphore, and a
+   stale one only costs another look.
+*/
+static void dqsleep(dq_ring *q, atomic_int *waiting, sem_t *s, bool (*ready)(dq_ring *q)){
+    while (1) {
+        atomic_store(waiting, 1);
+        if (ready(q)) {
+            atomic_store(waiting, 0);
+            return;
+        }
+        dqwait(s);
+    }
+}
+
+/*
+ * Wakes the other side if it is asleep, or about to be, on s
+*/
+static void dqwake(atomic_int *waiting, sem_t *s){
+    if (atomic_load(waiting) && atomic_exchange(waiting, 0))
+        sem_post(s);
+}
+
+static bool dqhasroom(dq_ring *q){
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    return tail - atomic_load(&q->head) < (unsigned)q->count;
+}
+
+static bool dqhasslot(dq_ring *q){
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    return atomic_load(&q->tail) != head;
+}
+
+/*
+ * Producer: returns the next slot to fill, waiting for the consumer to
+   free one if the ring is full
+*/
+void *dqreserve(dq_ring *q){
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&q->head, memory_order_acquire) >= (unsigned)q->count)
+        dqsleep(q, &q->prodWaiting, &q->empty, dqhasroom);
+    return q->slots + (size_t)(tail % q->count) * q->slotSz;
+}
+
+/*
+ * Producer: publishes the slot dqreserve() returned
+*/
+void dqpush(dq_ring *q){
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    atomic_store(&q->tail, tail + 1);
+    dqwake(&q->consWaiting, &q->filled);
+}
+
+/*
+ * Consumer: returns the oldest published slot, waiting for one if the
+   ring is empty
+*/
+void *dqpeek(dq_ring *q){
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if (atomic_load_explicit(&q->tail, memory_order_acquire) == head)
+        dqsleep(q, &q->consWaiting, &q->filled, dqhasslot);
+    return q->slots + (size_t)(head % q->count) * q->slotSz;
+}
+
+/*
+ * Consumer: hands the slot dqpeek() returned back to the producer
+*/
+void dqpop(dq_ring *q){
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    atomic_store(&q->head, head + 1);
+    dqwake(&q->prodWaiting, &q->empty);
+}
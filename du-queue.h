@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <semaphore.h>
+
+/*
+ * du-proto single producer, single consumer ring (dq)
+ * A fixed ring of equally sized slots that hands work from one thread to
+   another.  The producer fills the slot dqreserve() gives it in place
+   and publishes it with dqpush(), the consumer gets the oldest published
+   slot from dqpeek() and hands it back with dqpop(), so nothing is
+   copied and no lock is taken.
+ * head and tail are each written by one side only and sit on cache lines
+   of their own.  The producer looks for room by loading head and the
+   consumer for slots by loading tail (acquire), each publishes its own
+   index with a store the other side's load pairs with, so a side that
+   is not waiting takes no lock and makes no system call.
+ * A side that finds the ring full (or empty) raises its waiting flag,
+   looks once more and only then sleeps on its semaphore.  The other
+   side posts the semaphore only when it sees the flag after moving its
+   index; both sides store and then load with sequential consistency,
+   so at least one of them sees the other and no wakeup is lost.
+ */
+#define     DQ_ALIGN            64
+
+#define     DQ_NO_ERROR         0
+#define     DQ_ERROR_NOMEM      -1
+
+typedef struct dq_ring {
+    char            *slots;
+    int             slotSz;         //rounded up to DQ_ALIGN
+    int             count;
+    sem_t           filled;         //wakes a consumer that found the ring empty
+    sem_t           empty;          //wakes a producer that found the ring full
+    _Alignas(DQ_ALIGN) atomic_uint head;    //next slot the consumer takes
+    atomic_int      prodWaiting;    //the producer is asleep on empty, or about to be
+    _Alignas(DQ_ALIGN) atomic_uint tail;    //next slot the producer fills
+    atomic_int      consWaiting;    //the consumer is asleep on filled, or about to be
+} dq_ring;
+
+int   dqinit(dq_ring *q, int slot_sz, int count);
+void  dqdestroy(dq_ring *q);
+void *dqreserve(dq_ring *q);
+void  dqpush(dq_ring *q);
+void *dqpeek(dq_ring *q);
+void  dqpop(dq_ring *q);
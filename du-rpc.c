@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "du-rpc.h"
+
+/*
+ * Sets up a session on a connected dp_connection, either side uses it
+*/
+int drinit(dr_session *rs, dp_connp dp){
+    bzero(rs, sizeof(dr_session));
+    rs->dp = dp;
+    rs->nextId = 1;
+    rs->sbuf = malloc(DR_MSG_SZ);
+    rs->rbuf = malloc(DR_MSG_SZ);
+    if (rs->sbuf == NULL || rs->rbuf == NULL) {
+        drfree(rs);
+        return DR_ERROR_GENERAL;
+    }
+    return DR_NO_ERROR;
+}
+
+void drfree(dr_session *rs){
+    free(rs->sbuf);
+    free(rs->rbuf);
+    rs->sbuf = rs->rbuf = NULL;
+}
+
+/*
+ * Appends a record to this side's next turn and returns where its
+   payload goes, or NULL if the turn is full
+*/
+static char *dradd(dr_session *rs, int mtype, uint32_t id, int method, int status, int data_sz){
+    dr_hdr hdr = {0};
+
+    if (data_sz < 0 || data_sz > DR_MAX_DATA || rs->sLen + sizeof(dr_hdr) + data_sz > DR_MSG_SZ)
+        return NULL;
+    hdr.proto_ver = DR_PROTO_VER_1;
+    hdr.mtype = mtype;
+    hdr.id = id;
+    hdr.method = method;
+    hdr.status = status;
+    hdr.data_sz = data_sz;
+    memcpy(rs->sbuf + rs->sLen, &hdr, sizeof(dr_hdr));
+    rs->sLen += sizeof(dr_hdr) + data_sz;
+    return rs->sbuf + rs->sLen - data_sz;
+}
+
+/*
+ * Takes this side's turn, everything queued goes out as one message.
+ * An empty turn is still a message, the peer is waiting for one.
+*/
+static int drturn(dr_session *rs){
+    ssize_t rc;
+
+    if (rs->sLen == 0)
+        dradd(rs, DR_MT_TURN, 0, 0, DR_NO_ERROR, 0);
+    rc = dpsend(rs->dp, rs->sbuf, rs->sLen);
+    rs->sLen = 0;
+    return (rc < 0) ? (int)rc : DR_NO_ERROR;
+}
+
+/*
+ * Waits for the peer's turn, returns its size
+*/
+static int drrecv(dr_session *rs){
+    return (int)dprecv(rs->dp, rs->rbuf, DR_MSG_SZ);
+}
+
+/*
+ * Copies out the header of the record at off of a received message,
+   DR_ERROR_PROTOCOL if the record is malformed or runs past the end
+*/
+static int drrecord(dr_session *rs, int off, int len, dr_hdr *hdr){
+    if (off + (int)sizeof(dr_hdr) > len)
+        return DR_ERROR_PROTOCOL;
+    memcpy(hdr, rs->rbuf + off, sizeof(dr_hdr));
+    if (hdr->proto_ver != DR_PROTO_VER_1 || hdr->data_sz < 0 ||
+            off + sizeof(dr_hdr) + hdr->data_sz > len)
+        return DR_ERROR_PROTOCOL;
+    return DR_NO_ERROR;
+}
+
+static dr_call *drfind(dr_session *rs, uint32_t id){
+    for (int i = 0; i < DR_MAX_CALLS; i++)
+        if (rs->calls[i].id == id && id != 0)
+            return &rs->calls[i];
+    return NULL;
+}
+
+/*
+ * Client: queues a request for the next turn and returns its id.
+ * The response is copied to resp (resp_cap bytes) when it comes in,
+   drwait() says when that was.  Nothing is sent until drwait().
+*/
+int drcall(dr_session *rs, int method, const void *req, int req_sz, void *resp, int resp_cap){
+    dr_call *c = NULL;
+    char *payload;
+
+    for (int i = 0; c == NULL && i < DR_MAX_CALLS; i++)
+        if (rs->calls[i].id == 0)
+            c = &rs->calls[i];
+    if (c == NULL)
+        return DR_ERROR_TOO_MANY;
+
+    // Ids skip 0, it marks a free slot
+    if (rs->nextId == 0)
+        rs->nextId = 1;
+    payload = dradd(rs, DR_MT_REQUEST, rs->nextId, method, DR_NO_ERROR, req_sz);
+    if (payload == NULL)
+        return DR_ERROR_TOO_BIG;
+    if (req_sz > 0)
+        memcpy(payload, req, req_sz);
+
+    c->id = rs->nextId++;
+    c->done = false;
+    c->status = DR_NO_ERROR;
+    c->resp = resp;
+    c->resp_cap = resp_cap;
+    c->resp_sz = 0;
+    rs->outstanding++;
+    return c->id;
+}
+
+/*
+ * Client: waits until call *id (or with DR_ANY whichever call comes
+   first) has its response, taking turns with the server as needed.
+ * On return *id is the call that finished and *status what the server
+   reported for it, the return value is the size of the response (or a
+   negative error for the session as a whole).  The call's slot is free
+   again afterwards.
+*/
+int drwait(dr_session *rs, uint32_t *id, int *status){
+    dr_hdr hdr;
+    dr_call *c;
+    int len, rc;
+
+    while (1) {
+        for (int i = 0; i < DR_MAX_CALLS; i++) {
+            c = &rs->calls[i];
+            if (c->id == 0 || !c->done || (*id != DR_ANY && c->id != *id))
+                continue;
+            *id = c->id;
+            if (status != NULL)
+                *status = c->status;
+            c->id = 0;
+            rs->outstanding--;
+            return c->resp_sz;
+        }
+        if (rs->outstanding == 0 || (*id != DR_ANY && drfind(rs, *id) == NULL))
+            return DR_ERROR_UNKNOWN_ID;
+
+        if ((rc = drturn(rs)) != DR_NO_ERROR)
+            return rc;
+        if ((len = drrecv(rs)) < 0)
+            return len;
+
+        for (int off = 0; off < len; off += sizeof(dr_hdr) + hdr.data_sz) {
+            if (drrecord(rs, off, len, &hdr) != DR_NO_ERROR)
+                return DR_ERROR_PROTOCOL;
+            if (hdr.mtype == DR_MT_TURN)
+                continue;
+            if (hdr.mtype != DR_MT_RESPONSE || (c = drfind(rs, hdr.id)) == NULL || c->done) {
+                printf("drwait: unexpected record %d for call %u\n", hdr.mtype, hdr.id);
+                continue;
+            }
+            c->done = true;
+            c->status = hdr.status;
+            c->resp_sz = hdr.data_sz;
+            if (hdr.data_sz > c->resp_cap) {
+                c->status = DR_ERROR_TOO_BIG;
+                c->resp_sz = c->resp_cap;
+            }
+            memcpy(c->resp, rs->rbuf + off + sizeof(dr_hdr), c->resp_sz);
+        }
+    }
+}
+
+/*
+ * Server: handles one client turn.  Every request goes to fn, whose
+   response is written straight into the outgoing turn, then the server's
+   turn is sent back with those responses and any drreply() made since
+   its last turn.
+ * Returns how many requests were handled, or the dp error that ended
+   the session (DP_CONNECTION_CLOSED when the client is done).
+*/
+int drserve(dr_session *rs, dr_handler fn, void *arg){
+    dr_hdr hdr;
+    int len, rc, handled = 0;
+
+    if ((len = drrecv(rs)) < 0)
+        return len;
+
+    for (int off = 0; off < len; off += sizeof(dr_hdr) + hdr.data_sz) {
+        if (drrecord(rs, off, len, &hdr) != DR_NO_ERROR) {
+            printf("drserve: truncated record\n");
+            break;
+        }
+        if (hdr.mtype != DR_MT_REQUEST)
+            continue;
+
+        // The handler writes behind a header that is filled in afterwards
+        char *resp = dradd(rs, DR_MT_RESPONSE, hdr.id, hdr.method, DR_NO_ERROR, DR_MAX_DATA);
+        if (resp == NULL) {
+            // Deferred answers took the room, the client still gets told.
+            // A bare header always fits unless it has more than
+            // DR_MAX_CALLS calls out.
+            if (dradd(rs, DR_MT_RESPONSE, hdr.id, hdr.method, DR_ERROR_BUSY, 0) == NULL)
+                printf("drserve: no room to answer call %u\n", hdr.id);
+            continue;
+        }
+        rs->sLen -= sizeof(dr_hdr) + DR_MAX_DATA;
+
+        rc = fn(rs, hdr.id, hdr.method, rs->rbuf + off + sizeof(dr_hdr), hdr.data_sz,
+                resp, DR_MAX_DATA, arg);
+        handled++;
+        if (rc == DR_DEFERRED)
+            continue;
+        if (rc > DR_MAX_DATA)
+            rc = DR_ERROR_TOO_BIG;
+        dradd(rs, DR_MT_RESPONSE, hdr.id, hdr.method, (rc < 0) ? rc : DR_NO_ERROR, (rc < 0) ? 0 : rc);
+    }
+
+    rc = drturn(rs);
+    return (rc != DR_NO_ERROR) ? rc : handled;
+}
+
+/*
+ * Server: answers a call whose handler returned DR_DEFERRED, the
+   response goes out with the server's next turn
+*/
+int drreply(dr_session *rs, uint32_t id, int status, const void *resp, int resp_sz){
+    char *payload = dradd(rs, DR_MT_RESPONSE, id, 0, status, resp_sz);
+
+    if (payload == NULL)
+        return DR_ERROR_TOO_BIG;
+    if (resp_sz > 0)
+        memcpy(payload, resp, resp_sz);
+    return DR_NO_ERROR;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "du-proto.h"
+
+/*
+ * du-proto RPC layer (dr)
+ * Message oriented calls on top of a dp_connection.  Every request
+   carries an id, a client can have up to DR_MAX_CALLS of them outstanding
+   and the responses come back in whatever order the server finishes them.
+ * du-proto carries one message at a time, so the two sides take turns.
+   On its turn the client sends every request queued since its last one
+   as a single message, so a whole batch of calls costs one round trip.
+   The server answers every turn with one message holding the responses
+   that are ready, or just a DR_MT_TURN record if there are none.  A
+   client that waits on a call the server has not finished yet hands the
+   server another turn with an empty message.
+ * A server handler may return DR_DEFERRED and answer later with
+   drreply(), the response goes out with the server's next turn.  A call
+   that arrives while deferred answers leave no room for a full response
+   is answered with DR_ERROR_BUSY right away.
+ * A message is a run of records, each a dr_hdr followed by data_sz bytes
+   of payload.
+ */
+#define     DR_PROTO_VER_1      1
+
+#define     DR_MT_REQUEST       1
+#define     DR_MT_RESPONSE      2
+#define     DR_MT_TURN          3       //nothing to say this turn
+
+#define     DR_MAX_CALLS        64
+#define     DR_MAX_DATA         4096    //largest request or response payload
+#define     DR_MSG_SZ           ((DR_MAX_CALLS + 1) * (sizeof(dr_hdr) + DR_MAX_DATA))
+
+#define     DR_ANY              0       //drwait(): whichever call finishes first
+
+#define     DR_NO_ERROR         0
+#define     DR_ERROR_GENERAL    -1
+#define     DR_ERROR_PROTOCOL   -2
+#define     DR_ERROR_TOO_MANY   -3      //DR_MAX_CALLS are outstanding already
+#define     DR_ERROR_TOO_BIG    -4      //payload larger than DR_MAX_DATA or the response buffer
+#define     DR_ERROR_UNKNOWN_ID -5
+#define     DR_DEFERRED         -6      //handler: the answer comes later with drreply()
+#define     DR_ERROR_BUSY       -7      //the server had no room to answer this turn, call again
+
+typedef struct dr_hdr {
+    int         proto_ver;
+    int         mtype;
+    uint32_t    id;
+    int         method;         //requests: which call
+    int         status;         //responses: DR_NO_ERROR or what the handler failed with
+    int         data_sz;
+} dr_hdr;
+
+//Client side state of one outstanding call
+typedef struct dr_call {
+    uint32_t    id;             //0 = slot is free
+    _Bool       done;
+    int         status;
+    void        *resp;          //the response is copied here
+    int         resp_cap;
+    int         resp_sz;
+} dr_call;
+
+typedef struct dr_session {
+    dp_connp    dp;
+    uint32_t    nextId;
+    char        *sbuf;          //records queued for this side's next turn
+    int         sLen;
+    char        *rbuf;          //last message received
+    dr_call     calls[DR_MAX_CALLS];
+    int         outstanding;
+} dr_session;
+
+/*
+ * Server handler, called once per request.  The response can be written
+   straight to resp (resp_cap bytes), the return value is its size, a
+   negative error that is sent back as the status, or DR_DEFERRED.
+ */
+typedef int (*dr_handler)(dr_session *rs, uint32_t id, int method, const void *req,
+                            int req_sz, void *resp, int resp_cap, void *arg);
+
+int  drinit(dr_session *rs, dp_connp dp);
+void drfree(dr_session *rs);
+int  drcall(dr_session *rs, int method, const void *req, int req_sz, void *resp, int resp_cap);
+int  drwait(dr_session *rs, uint32_t *id, int *status);
+int  drserve(dr_session *rs, dr_handler fn, void *arg);
+int  drreply(dr_session *rs, uint32_t id, int status, const void *resp, int resp_sz);
@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "du-shm.h"
+
+#define DM_SLOT_HDR     8           //datagram length in front of every slot
+
+static void dmreset(dm_link *l){
+    bzero(l, sizeof(dm_link));
+    l->memFd = l->evFd[0] = l->evFd[1] = -1;
+}
+
+static char *dmslot(dm_link *l, int ring, unsigned idx){
+    char *base = (char *)l->shm + ((sizeof(dm_shared) + DM_ALIGN - 1) & ~(DM_ALIGN - 1));
+    return base + ((size_t)ring * l->slots + idx % l->slots) * l->stride;
+}
+
+static size_t dmmapsz(uint32_t slots, uint32_t stride){
+    return ((sizeof(dm_shared) + DM_ALIGN - 1) & ~(DM_ALIGN - 1)) + 2 * (size_t)slots * stride;
+}
+
+/*
+ * Creates a link of two rings of slots datagrams of up to slot_sz bytes
+   each, this side is its creator.  The pages are only backed as they
+   are touched.
+*/
+int dmcreate(dm_link *l, int slots, int slot_sz, uint64_t token){
+    uint32_t stride = (DM_SLOT_HDR + slot_sz + DM_ALIGN - 1) & ~(DM_ALIGN - 1);
+
+    dmreset(l);
+    if (slots <= 0 || slots > DM_MAX_SLOTS || slot_sz <= 0)
+        return DM_ERROR_GENERAL;
+    l->mapSz = dmmapsz(slots, stride);
+
+    l->memFd = memfd_create("du-proto", MFD_CLOEXEC);
+    if (l->memFd < 0 || ftruncate(l->memFd, l->mapSz) != 0) {
+        perror("dmcreate: cannot create the shared memory");
+        dmclose(l);
+        return DM_ERROR_GENERAL;
+    }
+    l->shm = mmap(NULL, l->mapSz, PROT_READ | PROT_WRITE, MAP_SHARED, l->memFd, 0);
+    if (l->shm == MAP_FAILED) {
+        perror("dmcreate: cannot map the shared memory");
+        l->shm = NULL;
+        dmclose(l);
+        return DM_ERROR_GENERAL;
+    }
+    l->evFd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    l->evFd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (l->evFd[0] < 0 || l->evFd[1] < 0) {
+        perror("dmcreate: cannot create the eventfds");
+        dmclose(l);
+        return DM_ERROR_GENERAL;
+    }
+
+    l->shm->slots = l->slots = slots;
+    l->shm->slotSz = l->slotSz = slot_sz;
+    l->shm->stride = l->stride = stride;
+    l->shm->token = token;
+    for (int i = 0; i < 2; i++) {
+        atomic_init(&l->shm->ring[i].head, 0);
+        atomic_init(&l->shm->ring[i].tail, 0);
+    }
+    l->shm->magic = DM_MAGIC;
+    l->side = 0;
+    return DM_NO_ERROR;
+}
+
+static socklen_t dmaddr(struct sockaddr_un *addr, const char *name){
+    // Abstract namespace, nothing to clean up in the file system
+    bzero(addr, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path + 1, name, sizeof(addr->sun_path) - 2);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+}
+
+/*
+ * Opens the socket offers for name arrive on, returns it or -1 if
+   another process has name already
+*/
+int dmlisten(const char *name){
+    struct sockaddr_un addr;
+    socklen_t len = dmaddr(&addr, name);
+    int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (sock < 0)
+        return -1;
+    if (bind(sock, (struct sockaddr *)&addr, len) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Sends the link's token with its memfd and eventfds to the socket
+   dmlisten() opened for name
+*/
+int dmoffer(dm_link *l, const char *name){
+    struct sockaddr_un addr;
+    int fds[3] = { l->memFd, l->evFd[0], l->evFd[1] };
+    char ctrl[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = { .iov_base = &l->shm->token, .iov_len = sizeof(uint64_t) };
+    struct msghdr msg = {0};
+    struct cmsghdr *c;
+    int sock, rc;
+
+    msg.msg_name = &addr;
+    msg.msg_namelen = dmaddr(&addr, name);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    if ((sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return DM_ERROR_GENERAL;
+    rc = sendmsg(sock, &msg, MSG_DONTWAIT);
+    close(sock);
+    return (rc == sizeof(uint64_t)) ? DM_NO_ERROR : DM_ERROR_GENERAL;
+}
+
+/*
+ * Takes the offers queued on sock until the one with token turns up and
+   maps its link, this side is the peer.  Offers for other tokens are
+   stale and dropped.  The mapping is checked against what the memfd
+   really holds, the creator is not trusted with the sizes.
+*/
+int dmaccept(dm_link *l, int sock, uint64_t token){
+    int fds[3];
+    char ctrl[CMSG_SPACE(sizeof(fds))];
+    uint64_t got;
+    struct iovec iov = { .iov_base = &got, .iov_len = sizeof(got) };
+    struct msghdr msg;
+    struct cmsghdr *c;
+    struct stat st;
+
+    dmreset(l);
+    while (1) {
+        bzero(&msg, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        if (recvmsg(sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) < 0) {
+            if (errno == EINTR)
+                continue;
+            return DM_ERROR_GENERAL;
+        }
+        c = CMSG_FIRSTHDR(&msg);
+        if (c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+            continue;
+        int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (n > 3)
+            n = 3;
+        memcpy(fds, CMSG_DATA(c), n * sizeof(int));
+        if (n == 3 && got == token && !(msg.msg_flags & MSG_CTRUNC))
+            break;
+        for (int i = 0; i < n; i++)
+            close(fds[i]);
+    }
+
+    l->memFd = fds[0];
+    l->evFd[0] = fds[1];
+    l->evFd[1] = fds[2];
+    l->side = 1;
+    if (fstat(l->memFd, &st) != 0 || st.st_size < (off_t)sizeof(dm_shared)) {
+        dmclose(l);
+        return DM_ERROR_GENERAL;
+    }
+    l->mapSz = st.st_size;
+    l->shm = mmap(NULL, l->mapSz, PROT_READ | PROT_WRITE, MAP_SHARED, l->memFd, 0);
+    if (l->shm == MAP_FAILED) {
+        l->shm = NULL;
+        dmclose(l);
+        return DM_ERROR_GENERAL;
+    }
+    if (l->shm->magic != DM_MAGIC || l->shm->token != token ||
+            l->shm->slots == 0 || l->shm->slots > DM_MAX_SLOTS ||
+            l->shm->stride < DM_SLOT_HDR + l->shm->slotSz ||
+            dmmapsz(l->shm->slots, l->shm->stride) > l->mapSz) {
+        printf("dmaccept: the offered link is malformed\n");
+        dmclose(l);
+        return DM_ERROR_GENERAL;
+    }
+    l->slots = l->shm->slots;
+    l->slotSz = l->shm->slotSz;
+    l->stride = l->shm->stride;
+    return DM_NO_ERROR;
+}
+
+/*
+ * Puts a datagram gathered from iov into this side's sending ring and
+   wakes the peer up if the ring was empty.  Returns its size,
+   DM_ERROR_FULL if there was no room (it is dropped) or DM_ERROR_SIZE.
+*/
+ssize_t dmsend(dm_link *l, const struct iovec *iov, int iovcnt){
+    dm_ring *r = &l->shm->ring[l->side];
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t len = 0;
+    char *slot, *p;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len > l->slotSz)
+        return DM_ERROR_SIZE;
+    if (tail - atomic_load(&r->head) >= l->slots) {
+        r->drops++;
+        return DM_ERROR_FULL;
+    }
+
+    slot = dmslot(l, l->side, tail);
+    p = slot + DM_SLOT_HDR;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    memcpy(slot, &len, sizeof(len));
+
+    /*
+     * Publishing the tail and then looking at the head (both sequentially
+       consistent) pairs with dmrecv() moving the head and then looking
+       at the tail: either the receiver sees this datagram before it
+       sleeps, or this side sees that it emptied the ring and wakes it.
+    */
+    atomic_store(&r->tail, tail + 1);
+    if (atomic_load(&r->head) == tail) {
+        uint64_t one = 1;
+        if (write(l->evFd[l->side], &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("dmsend: cannot wake the peer");
+    }
+    return len;
+}
+
+static int dmpop(dm_link *l, void *buf, size_t len){
+    dm_ring *r = &l->shm->ring[1 - l->side];
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t sz;
+    char *slot;
+
+    if (atomic_load(&r->tail) == head)
+        return -1;
+    slot = dmslot(l, 1 - l->side, head);
+    memcpy(&sz, slot, sizeof(sz));
+    if (sz > l->slotSz)
+        sz = 0;
+    if (sz > len)
+        sz = len;
+    memcpy(buf, slot + DM_SLOT_HDR, sz);
+    atomic_store(&r->head, head + 1);
+    return sz;
+}
+
+/*
+ * Takes the next datagram the peer sent, a datagram longer than len is
+   cut short as recv() would.  Never blocks: with nothing there it
+   returns -1 with errno EAGAIN and dmfd() becomes readable once there is.
+*/
+ssize_t dmrecv(dm_link *l, void *buf, size_t len){
+    uint64_t cnt;
+    int sz;
+
+    if ((sz = dmpop(l, buf, len)) >= 0)
+        return sz;
+
+    // Clear the wakeup before looking again, one that comes after is kept
+    if (read(l->evFd[1 - l->side], &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        return -1;
+    if ((sz = dmpop(l, buf, len)) >= 0)
+        return sz;
+    errno = EAGAIN;
+    return -1;
+}
+
+/*
+ * Descriptor to poll() for datagrams from the peer
+*/
+int dmfd(dm_link *l){
+    return l->evFd[1 - l->side];
+}
+
+void dmclose(dm_link *l){
+    if (l->shm != NULL)
+        munmap(l->shm, l->mapSz);
+    if (l->memFd >= 0)
+        close(l->memFd);
+    for (int i = 0; i < 2; i++)
+        if (l->evFd[i] >= 0)
+            close(l->evFd[i]);
+    dmreset(l);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * du-proto shared memory link (dm)
+ * Two processes on the same host exchange datagrams through two rings of
+   fixed size slots in one memfd mapping, one ring per direction, instead
+   of through the network stack.  A datagram is copied into a slot by the
+   sender and out of it by the receiver, nothing else.
+ * Each ring has an eventfd that the sender writes when it puts a
+   datagram into the ring while it was empty.  A receiver that finds its
+   ring empty sleeps in poll() on dmfd(), so a busy link costs no system
+   calls at all and an idle one a single wakeup.
+ * The side that creates the link (dmcreate()) offers the memfd and both
+   eventfds to its peer over an AF_UNIX datagram socket (dmoffer(), the
+   descriptors go along as SCM_RIGHTS), the peer picks them up from the
+   socket it made with dmlisten() and maps the same memory (dmaccept()).
+   The token of an offer tells the peer which connection it belongs to.
+ * A full ring drops the datagram, as a full socket buffer would.
+ */
+#define     DM_ALIGN            64
+#define     DM_MAGIC            0x6c6d7564      //"duml"
+#define     DM_MAX_SLOTS        65536
+
+#define     DM_NO_ERROR         0
+#define     DM_ERROR_GENERAL    -1
+#define     DM_ERROR_FULL       -2      //the datagram was dropped
+#define     DM_ERROR_SIZE       -3      //the datagram does not fit a slot
+
+typedef struct dm_ring {
+    _Alignas(DM_ALIGN) atomic_uint head;    //next slot the receiver takes
+    _Alignas(DM_ALIGN) atomic_uint tail;    //next slot the sender fills
+    uint32_t        drops;                  //datagrams the sender found no room for
+} dm_ring;
+
+//Start of the mapping, the slots of ring 0 and then ring 1 follow it
+typedef struct dm_shared {
+    uint32_t        magic;
+    uint32_t        slots;          //per ring
+    uint32_t        slotSz;         //largest datagram a slot takes
+    uint32_t        stride;         //bytes from one slot to the next
+    uint64_t        token;
+    dm_ring         ring[2];        //0 carries datagrams from the creator, 1 to it
+} dm_shared;
+
+typedef struct dm_link {
+    dm_shared       *shm;
+    size_t          mapSz;
+    int             memFd;
+    int             evFd[2];        //written when ring[i] stops being empty
+    int             side;           //0 = creator, sends on ring[side]
+    uint32_t        slots;          //checked copies, the peer could change shm's
+    uint32_t        slotSz;
+    uint32_t        stride;
+} dm_link;
+
+int     dmcreate(dm_link *l, int slots, int slot_sz, uint64_t token);
+int     dmlisten(const char *name);
+int     dmoffer(dm_link *l, const char *name);
+int     dmaccept(dm_link *l, int sock, uint64_t token);
+ssize_t dmsend(dm_link *l, const struct iovec *iov, int iovcnt);
+ssize_t dmrecv(dm_link *l, void *buf, size_t len);
+int     dmfd(dm_link *l);
+void    dmclose(dm_link *l);
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "du-stream.h"
+
+/*
+ * Sets up streams on a connected dp_connection, either side uses it
+*/
+int dsinit(ds_conn *ds, dp_connp dp){
+    bzero(ds, sizeof(ds_conn));
+    ds->dp = dp;
+    ds->nextId = 1;
+    ds->rbuf = malloc(DS_MSG_SZ);
+    if (ds->rbuf == NULL)
+        return DS_ERROR_GENERAL;
+    return DS_NO_ERROR;
+}
+
+void dsfree(ds_conn *ds){
+    free(ds->rbuf);
+    ds->rbuf = NULL;
+}
+
+static ds_stream *dsfind(ds_conn *ds, uint32_t id){
+    for (int i = 0; i < DS_MAX_STREAMS; i++)
+        if (ds->streams[i].id == id && id != 0)
+            return &ds->streams[i];
+    return NULL;
+}
+
+static ds_stream *dsslot(ds_conn *ds, uint32_t id){
+    for (int i = 0; i < DS_MAX_STREAMS; i++) {
+        if (ds->streams[i].id != 0)
+            continue;
+        bzero(&ds->streams[i], sizeof(ds_stream));
+        ds->streams[i].id = id;
+        ds->streams[i].prio = DS_PRIO_DEF;
+        ds->streams[i].weight = 1;
+        return &ds->streams[i];
+    }
+    return NULL;
+}
+
+/*
+ * Opens an outgoing stream and returns its id
+*/
+int dsopen(ds_conn *ds){
+    if (ds->nextId == 0)
+        ds->nextId = 1;
+    if (dsslot(ds, ds->nextId) == NULL)
+        return DS_ERROR_TOO_MANY;
+    return ds->nextId++;
+}
+
+/*
+ * Queues buf for the stream, it is sent from where it is by dssend()
+*/
+int dswrite(ds_conn *ds, uint32_t id, const void *buf, size_t len){
+    ds_stream *s = dsfind(ds, id);
+
+    if (s == NULL || s->txClosed)
+        return DS_ERROR_STREAM;
+    if (len == 0)
+        return DS_NO_ERROR;
+    if (s->txCnt == DS_TX_SEGS)
+        return DS_ERROR_FULL;
+    s->tx[(s->txHead + s->txCnt) % DS_TX_SEGS].iov_base = (void *)buf;
+    s->tx[(s->txHead + s->txCnt) % DS_TX_SEGS].iov_len = len;
+    s->txCnt++;
+    return DS_NO_ERROR;
+}
+
+/*
+ * Ends the stream once everything queued for it is sent
+*/
+int dsclose(ds_conn *ds, uint32_t id){
+    ds_stream *s = dsfind(ds, id);
+
+    if (s == NULL || s->txClosed)
+        return DS_ERROR_STREAM;
+    s->txClosed = true;
+    return DS_NO_ERROR;
+}
+
+/*
+ * Sets the priority (0 most urgent .. DS_PRIO_LEVELS - 1) and the weight
+   (1 .. DS_MAX_WEIGHT) the stream is scheduled with
+*/
+int dssetprio(ds_conn *ds, uint32_t id, int prio, int weight){
+    ds_stream *s = dsfind(ds, id);
+
+    if (s == NULL)
+        return DS_ERROR_STREAM;
+    if (prio < 0 || prio >= DS_PRIO_LEVELS || weight < 1 || weight > DS_MAX_WEIGHT)
+        return DS_ERROR_GENERAL;
+    s->prio = prio;
+    s->weight = weight;
+    return DS_NO_ERROR;
+}
+
+/*
+ * True until the stream's FIN has gone out, its buffers can be reused after
+*/
+_Bool dsbusy(ds_conn *ds, uint32_t id){
+    return dsfind(ds, id) != NULL;
+}
+
+/*
+ * Takes the next frame of s, up to quantum bytes from its queued buffers
+*/
+static int dsframe(ds_conn *ds, ds_stream *s, ds_frame *fr, int *nIov, size_t quantum){
+    size_t take = 0, n;
+
+    while (s->txCnt > 0 && take < quantum && *nIov < DS_MAX_IOV) {
+        struct iovec *seg = &s->tx[s->txHead];
+        n = seg->iov_len - s->txSegOff;
+        if (n > quantum - take)
+            n = quantum - take;
+        ds->iov[*nIov].iov_base = (char *)seg->iov_base + s->txSegOff;
+        ds->iov[*nIov].iov_len = n;
+        (*nIov)++;
+        take += n;
+        s->txSegOff += n;
+        if (s->txSegOff == seg->iov_len) {
+            s->txHead = (s->txHead + 1) % DS_TX_SEGS;
+            s->txCnt--;
+            s->txSegOff = 0;
+        }
+    }
+
+    fr->stream = s->id;
+    fr->flags = 0;
+    fr->offset = s->txOff;
+    fr->data_sz = take;
+    fr->rsvd = 0;
+    s->txOff += take;
+    if (s->txCnt == 0 && s->txClosed) {
+        fr->flags |= DS_FL_FIN;
+        s->id = 0;
+    }
+    return take;
+}
+
+static bool dsready(ds_stream *s){
+    return s->id != 0 && (s->txCnt > 0 || s->txClosed);
+}
+
+//Level the stream is served at in this message, see Scheduling in du-stream.h
+static int dslevel(ds_stream *s){
+    return (s->waited >= DS_AGE_MSGS) ? 0 : s->prio;
+}
+
+/*
+ * Sends one message with frames of the streams that have something to
+   send, returns its size or 0 if there was nothing.
+ * Levels are filled in order, the streams of a level take deficit round
+   robin turns until the message is full or none has data left.  A turn
+   cut short by a full message is finished first in the next one.
+*/
+ssize_t dssend(ds_conn *ds){
+    int nIov = 0, nFrames = 0, sent;
+    bool served[DS_MAX_STREAMS] = {0};
+    int level[DS_MAX_STREAMS];
+    size_t msgSz = 0, room;
+    bool progress, full = false;
+    ssize_t rc;
+
+    for (int i = 0; i < DS_MAX_STREAMS; i++)
+        level[i] = dslevel(&ds->streams[i]);
+
+    for (int lv = 0; lv < DS_PRIO_LEVELS && !full; lv++) {
+        progress = true;
+        while (progress && !full) {
+            progress = false;
+            int start = ds->rrNext[lv];
+            for (int n = 0; n < DS_MAX_STREAMS; n++) {
+                int i = (start + n) % DS_MAX_STREAMS;
+                ds_stream *s = &ds->streams[i];
+                if (!dsready(s) || level[i] != lv)
+                    continue;
+                if (nFrames == DS_MAX_FRAMES || nIov + 2 > DS_MAX_IOV ||
+                        msgSz + sizeof(ds_frame) >= DS_MSG_SZ) {
+                    ds->rrNext[lv] = i;
+                    full = true;
+                    break;
+                }
+
+                if (s->deficit <= 0)
+                    s->deficit += (long)s->weight * DS_QUANTUM;
+                room = DS_MSG_SZ - msgSz - sizeof(ds_frame);
+                if (room > s->deficit)
+                    room = s->deficit;
+
+                ds_frame *fr = &ds->frames[nFrames++];
+                ds->iov[nIov].iov_base = fr;
+                ds->iov[nIov++].iov_len = sizeof(ds_frame);
+                sent = dsframe(ds, s, fr, &nIov, room);
+                msgSz += sizeof(ds_frame) + sent;
+                s->deficit -= sent;
+                served[i] = true;
+                progress = true;
+
+                // An idle stream does not keep what is left of its turn
+                if (!dsready(s))
+                    s->deficit = 0;
+                if (s->deficit > 0) {
+                    ds->rrNext[lv] = i;
+                    break;
+                }
+                ds->rrNext[lv] = (i + 1) % DS_MAX_STREAMS;
+            }
+        }
+    }
+    if (nFrames == 0)
+        return 0;
+
+    for (int i = 0; i < DS_MAX_STREAMS; i++) {
+        if (served[i])
+            ds->streams[i].waited = 0;
+        else if (dsready(&ds->streams[i]))
+            ds->streams[i].waited++;
+    }
+
+    rc = dpsendv(ds->dp, ds->iov, nIov);
+    return (rc < 0) ? rc : (ssize_t)msgSz;
+}
+
+/*
+ * Sends until every stream has sent what is queued for it,
+   returns DS_NO_ERROR or the dp error that stopped it
+*/
+int dsflush(ds_conn *ds){
+    ssize_t rc;
+
+    while ((rc = dssend(ds)) > 0)
+        ;
+    return (int)rc;
+}
+
+/*
+ * Returns the next frame received, receiving a new message once every
+   frame of the current one has been handed out.
+ * On success *id is its stream, *data points at the data, *fin is set
+   on the stream's last frame and the return value is the data size.
+*/
+int dsrecv(ds_conn *ds, uint32_t *id, char **data, int *fin){
+    ds_frame fr;
+    ds_stream *s;
+    ssize_t rc;
+
+    while (ds->rOff + (int)sizeof(ds_frame) > ds->rLen) {
+        rc = dprecv(ds->dp, ds->rbuf, DS_MSG_SZ);
+        if (rc < 0)
+            return (int)rc;
+        ds->rLen = rc;
+        ds->rOff = 0;
+    }
+
+    memcpy(&fr, ds->rbuf + ds->rOff, sizeof(ds_frame));
+    if (fr.data_sz < 0 || ds->rOff + sizeof(ds_frame) + fr.data_sz > ds->rLen) {
+        printf("dsrecv: truncated frame\n");
+        ds->rOff = ds->rLen;
+        return DS_ERROR_PROTOCOL;
+    }
+    *data = ds->rbuf + ds->rOff + sizeof(ds_frame);
+    ds->rOff += sizeof(ds_frame) + fr.data_sz;
+
+    // A stream is new when its first frame arrives
+    if ((s = dsfind(ds, fr.stream)) == NULL) {
+        if (fr.offset != 0)
+            return DS_ERROR_SEQUENCE;
+        if ((s = dsslot(ds, fr.stream)) == NULL)
+            return DS_ERROR_TOO_MANY;
+    }
+    if (fr.offset != s->rxOff)
+        return DS_ERROR_SEQUENCE;
+    s->rxOff += fr.data_sz;
+    if (fr.flags & DS_FL_FIN)
+        s->id = 0;
+
+    *id = fr.stream;
+    *fin = (fr.flags & DS_FL_FIN) ? 1 : 0;
+    return fr.data_sz;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "du-proto.h"
+
+/*
+ * du-proto streams (ds)
+ * Many independent byte streams share one dp_connection.  Data goes out
+   in frames tagged with the stream id and the stream offset of its first
+   byte, and the receiver checks and puts every stream back together on
+   its own.  A stream is opened by its first frame and ends with the
+   frame flagged DS_FL_FIN, streams are one way.
+ * dssend() builds each dp message from frames of the streams that have
+   data queued, so a small stream gets into the next message instead of
+   waiting behind a large one (see Scheduling below).  Data is gathered
+   straight from the buffers handed to dswrite(), they must stay
+   untouched until dsbusy() says the stream is done.
+ * Loss is recovered by du-proto for the connection as a whole, and it
+   delivers whole messages.  A lost datagram holds up the streams with
+   frames in that one message, at most DS_MSG_SZ bytes between them,
+   never everything queued behind a large stream.
+ * du-proto carries one message at a time, so data flows one way: one
+   side dssend()s, the other dsrecv()s.
+ * A message is a run of frames, each a ds_frame followed by data_sz bytes.
+ */
+#define     DS_MAX_STREAMS      64
+#define     DS_TX_SEGS          4       //buffers a stream can have queued
+#define     DS_QUANTUM          16384   //bytes per turn of a weight 1 stream
+#define     DS_MSG_SZ           65536
+#define     DS_MAX_FRAMES       32      //frames per message
+#define     DS_MAX_IOV          64      //buffers a message is gathered from
+
+#define     DS_FL_FIN           1       //last frame of the stream
+
+/*
+ * Scheduling
+ * Every stream has a priority (0 is the most urgent) and a weight, see
+   dssetprio().  A message is filled by priority, a level only gets the
+   room the levels above it left.  Within a level the streams share by
+   deficit round robin: on its turn a stream may send weight * DS_QUANTUM
+   bytes, what a full message cut short is carried over to the next one,
+   so bandwidth is split by weight whatever the size of the writes.
+ * A stream that had data but got nothing for DS_AGE_MSGS messages in a
+   row is served at level 0 for one message, so bulk streams are slowed
+   down by urgent ones but never starved.
+ */
+#define     DS_PRIO_LEVELS      4
+#define     DS_PRIO_DEF         2
+#define     DS_MAX_WEIGHT       16
+#define     DS_AGE_MSGS         8
+
+#define     DS_NO_ERROR         0
+#define     DS_ERROR_GENERAL    -1
+#define     DS_ERROR_PROTOCOL   -2
+#define     DS_ERROR_TOO_MANY   -3      //DS_MAX_STREAMS are open already
+#define     DS_ERROR_FULL       -4      //DS_TX_SEGS buffers are queued already
+#define     DS_ERROR_STREAM     -5      //no such stream, or it was closed
+#define     DS_ERROR_SEQUENCE   -6      //frame does not continue its stream
+
+typedef struct ds_frame {
+    uint32_t    stream;
+    int         flags;
+    uint64_t    offset;         //stream offset of the first data byte
+    int         data_sz;
+    int         rsvd;
+} ds_frame;
+
+typedef struct ds_stream {
+    uint32_t    id;             //0 = slot is free
+    uint64_t    txOff;          //stream offset of the next byte to send
+    struct iovec tx[DS_TX_SEGS];//buffers queued by dswrite()
+    int         txHead;
+    int         txCnt;
+    size_t      txSegOff;       //bytes of tx[txHead] already sent
+    _Bool       txClosed;       //dsclose() was called, FIN follows the data
+    int         prio;
+    int         weight;
+    long        deficit;        //bytes left of this stream's current turn
+    int         waited;         //messages in a row it had data but got no frame
+    uint64_t    rxOff;          //stream offset the next frame has to start at
+} ds_stream;
+
+typedef struct ds_conn {
+    dp_connp    dp;
+    uint32_t    nextId;
+    ds_stream   streams[DS_MAX_STREAMS];
+    int         rrNext[DS_PRIO_LEVELS]; //slot each level's next round starts with
+    ds_frame    frames[DS_MAX_FRAMES];
+    struct iovec iov[DS_MAX_IOV];
+    char        *rbuf;          //last message received
+    int         rLen;
+    int         rOff;           //next frame in it
+} ds_conn;
+
+int  dsinit(ds_conn *ds, dp_connp dp);
+void dsfree(ds_conn *ds);
+int  dsopen(ds_conn *ds);
+int  dswrite(ds_conn *ds, uint32_t id, const void *buf, size_t len);
+int  dsclose(ds_conn *ds, uint32_t id);
+int  dssetprio(ds_conn *ds, uint32_t id, int prio, int weight);
+_Bool dsbusy(ds_conn *ds, uint32_t id);
+ssize_t dssend(ds_conn *ds);
+int  dsflush(ds_conn *ds);
+int  dsrecv(ds_conn *ds, uint32_t *id, char **data, int *fin);
@@ -0,0 +1,203 @@
+#include <stddef.h>
+#include <limits.h>
+
+#include "du-timer.h"
+
+/*
+ * Puts a timer on the slot that covers its expiry, relative to
+   the next tick the wheel will process
+*/
+static void dtadd(dt_wheel *w, dt_timer *t){
+    uint64_t exp = t->expires;
+    uint64_t delta;
+    dt_timer *head;
+    int level;
+
+    if ((int64_t)(exp - w->now) < 0)
+        exp = w->now;
+    delta = exp - w->now;
+    if (delta > DT_MAX_DELTA) {
+        delta = DT_MAX_DELTA;
+        exp = w->now + delta;
+    }
+
+    for (level = 0; level < DT_LEVELS - 1; level++)
+        if (delta < (1ULL << ((level + 1) * DT_SLOT_BITS)))
+            break;
+
+    head = &w->slot[level][(exp >> (level * DT_SLOT_BITS)) & DT_SLOT_MASK];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/*
+ * Takes a timer off whatever list it is on
+*/
+static void dtunlink(dt_timer *t){
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/*
+ * Moves every timer of a higher level slot down to where it belongs now
+*/
+static void dtcascade(dt_wheel *w, int level, int idx){
+    dt_timer *head = &w->slot[level][idx];
+    dt_timer *t = head->next;
+
+    head->next = head->prev = head;
+    while (t != head) {
+        dt_timer *n = t->next;
+        dtadd(w, t);
+        t = n;
+    }
+}
+
+/*
+ * Sets up an empty wheel, ticks up to now count as processed
+*/
+void dtinit(dt_wheel *w, uint64_t now){
+    w->now = now + 1;
+    w->count = 0;
+    for (int l = 0; l < DT_LEVELS; l++)
+        for (int s = 0; s < DT_SLOTS; s++)
+            w->slot[l][s].next = w->slot[l][s].prev = &w->slot[l][s];
+}
+
+/*
+ * Prepares a timer that calls fn(t, arg) when it fires
+*/
+void dtsetup(dt_timer *t, dt_func fn, void *arg){
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+/*
+ * (Re)starts a timer so it fires at tick expires, a timer that is
+   already pending is moved
+*/
+void dtstart(dt_wheel *w, dt_timer *t, uint64_t expires){
+    if (t->next != NULL)
+        dtunlink(t);
+    else
+        w->count++;
+    t->expires = expires;
+    dtadd(w, t);
+}
+
+/*
+ * Stops a timer, doing nothing if it is not pending
+*/
+void dtstop(dt_wheel *w, dt_timer *t){
+    if (t->next == NULL)
+        return;
+    dtunlink(t);
+    w->count--;
+}
+
+int dtpending(const dt_timer *t){
+    return t->next != NULL;
+}
+
+/*
+ * Processes every tick up to and including now, firing the timers
+   that are due.
+ * Callbacks may start and stop timers (including their own), a timer
+   started for a tick that has already been processed fires on the
+   next one.
+*/
+void dtadvance(dt_wheel *w, uint64_t now){
+    dt_timer due;
+
+    if (w->count == 0) {
+        if ((int64_t)(now - w->now) >= 0)
+            w->now = now + 1;
+        return;
+    }
+
+    while ((int64_t)(now - w->now) >= 0) {
+        uint64_t tick = w->now;
+        int idx = tick & DT_SLOT_MASK;
+
+        // Level 0 wrapped, bring down the next slot of the levels above
+        if (idx == 0) {
+            for (int l = 1; l < DT_LEVELS; l++) {
+                int li = (tick >> (l * DT_SLOT_BITS)) & DT_SLOT_MASK;
+                dtcascade(w, l, li);
+                if (li != 0)
+                    break;
+            }
+        }
+
+        // Splice the slot out so timers started by callbacks land elsewhere
+        dt_timer *head = &w->slot[0][idx];
+        if (head->next == head) {
+            w->now++;
+            continue;
+        }
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head->next = head->prev = head;
+        w->now++;
+
+        while (due.next != &due) {
+            dt_timer *t = due.next;
+            dtunlink(t);
+            if ((int64_t)(t->expires - tick) > 0) {
+                dtadd(w, t);            // parked, not due yet
+                continue;
+            }
+            w->count--;
+            t->fn(t, t->arg);
+        }
+    }
+}
+
+/*
+ * Returns how many ticks after the now last passed to dtadvance() the
+   wheel next needs to be advanced, or -1 if no timer is pending.
+ * For the higher levels this is when their next non empty slot
+   cascades, which may be earlier than any of its timers are due.
+*/
+int dtnext(dt_wheel *w){
+    uint64_t best = UINT64_MAX;
+
+    if (w->count == 0)
+        return -1;
+
+    for (int i = 0; i < DT_SLOTS; i++) {
+        dt_timer *head = &w->slot[0][(w->now + i) & DT_SLOT_MASK];
+        if (head->next != head) {
+            best = w->now + i;
+            break;
+        }
+    }
+
+    for (int l = 1; l < DT_LEVELS; l++) {
+        int shift = l * DT_SLOT_BITS;
+        uint64_t base = w->now >> shift;
+        int start = (w->now & ((1ULL << shift) - 1)) ? 1 : 0;
+
+        for (int j = start; j < start + DT_SLOTS; j++) {
+            dt_timer *head = &w->slot[l][(base + j) & DT_SLOT_MASK];
+            if (head->next != head) {
+                if (((base + j) << shift) < best)
+                    best = (base + j) << shift;
+                break;
+            }
+        }
+    }
+
+    if (best == UINT64_MAX)
+        return -1;
+    if (best - w->now + 1 > INT_MAX)
+        return INT_MAX;
+    return best - w->now + 1;
+}
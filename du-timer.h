@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * du-proto timer wheel (dt)
+ * A hierarchical timing wheel: DT_LEVELS levels of DT_SLOTS slots each,
+   one tick per slot on the first level, DT_SLOTS ticks per slot on the
+   second and so on.  A timer goes on the lowest level that reaches its
+   expiry and moves down a level (cascades) when the level below wraps
+   around to it, so starting, stopping and firing a timer are all O(1)
+   no matter how many timers are pending.
+ * Timers further out than the wheel reaches are parked on the last slot
+   they can reach and put back when they get there.
+ * Ticks are whatever unit the caller uses consistently, du-proto uses
+   milliseconds.
+ */
+#define     DT_LEVELS           4
+#define     DT_SLOT_BITS        6
+#define     DT_SLOTS            (1 << DT_SLOT_BITS)
+#define     DT_SLOT_MASK        (DT_SLOTS - 1)
+#define     DT_MAX_DELTA        ((1ULL << (DT_LEVELS * DT_SLOT_BITS)) - 1)
+
+typedef struct dt_timer dt_timer;
+typedef void (*dt_func)(dt_timer *t, void *arg);
+
+struct dt_timer {
+    dt_timer    *next;          //NULL while the timer is not pending
+    dt_timer    *prev;
+    uint64_t    expires;        //tick the timer is due at
+    dt_func     fn;
+    void        *arg;
+};
+
+typedef struct dt_wheel {
+    uint64_t    now;                            //next tick to be processed
+    int         count;                          //timers pending
+    dt_timer    slot[DT_LEVELS][DT_SLOTS];      //list heads
+} dt_wheel;
+
+void dtinit(dt_wheel *w, uint64_t now);
+void dtsetup(dt_timer *t, dt_func fn, void *arg);
+void dtstart(dt_wheel *w, dt_timer *t, uint64_t expires);
+void dtstop(dt_wheel *w, dt_timer *t);
+int  dtpending(const dt_timer *t);
+void dtadvance(dt_wheel *w, uint64_t now);
+int  dtnext(dt_wheel *w);